@@ -8,11 +8,83 @@
 
 typedef void (*agora_connnected_cb_t)(int uid);
 typedef void (*agora_msg_cb_t)(const char *msg, int msg_len);
+typedef void (*agora_ack_cb_t)(uint32_t msg_id, bool delivered);
+typedef void (*agora_key_frame_cb_t)(int conn_id, bool low);
+typedef void (*agora_bitrate_cb_t)(int conn_id, uint32_t target_bps);
+typedef void (*agora_viewer_cb_t)(int conn_id, int viewers);
+typedef void (*agora_path_cb_t)(bool rdt);
+
+typedef enum agora_role {
+	AGORA_ROLE_ARM = 0,	/* follower arm with cameras, uids 1000.. */
+	AGORA_ROLE_LEADER,	/* leader arm publisher, one connection, uid 2000 */
+} agora_role_e;
+
+/* Must be called before agora_init(), the default role is AGORA_ROLE_ARM. */
+void agora_set_role(agora_role_e role, agora_ack_cb_t acb);
 
 int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb);
 
+/*
+ * Arm role: number of camera connections (uids 1000..), 1 to 3, default 3.
+ * Must be called before agora_init(). Arm commands work on any of them.
+ */
+void agora_set_conn_num(int conn_num);
+
+/* Called when a viewer asks for a key frame on conn_id, low for the simulcast low stream. */
+void agora_set_key_frame_cb(agora_key_frame_cb_t kcb);
+
+/* Called when the SDK's congestion control changes the target bitrate of conn_id. */
+void agora_set_bitrate_cb(agora_bitrate_cb_t bcb);
+
+/*
+ * Called when the number of remote viewers on conn_id changes. Our own
+ * connections and the leader uid are not viewers. Frames are only sent to
+ * connections with viewers.
+ */
+void agora_set_viewer_cb(agora_viewer_cb_t vcb);
+
+/*
+ * Leader role: called on the sending thread when commands switch transport.
+ * Messages the RDT tunnel accepted, and acked, may be lost when it closes.
+ */
+void agora_set_path_cb(agora_path_cb_t pcb);
+
 void agora_final();
 
+typedef struct agora_send_stats {
+	uint32_t	sent;
+	uint32_t	failed;		/* rejected by the SDK */
+	uint32_t	dropped;	/* deltas dropped while waiting for an IDR */
+	uint32_t	collapses;	/* target bitrate fell below half of the previous one */
+	uint32_t	key_req;	/* key frames asked for by the send path */
+	bool		waiting;	/* currently waiting for an IDR */
+} agora_send_stats_t;
+
+/*
+ * Send one encoded frame on conn_id, on the low stream for HST_SUB frames.
+ * After a failed send or a bitrate collapse the connection's layer drops
+ * deltas until the next IDR and asks for one through the key frame callback.
+ * Returns 0 when sent, 1 when dropped that way, -1 on failure or without viewers.
+ */
 int agora_frame_send(int conn_id, const hal_frame_t *frame);
 
+/* Send one Opus frame (48 kHz) on conn_id, only while it has viewers. */
+int agora_audio_send(int conn_id, const hal_frame_t *frame);
+
+/* Send path counters of conn_id's high or low stream. */
+int agora_get_send_stats(int conn_id, bool low, agora_send_stats_t *stats);
+
+/*
+ * Leader role: send a command message to the arm, over the RDT tunnel when
+ * open and RTM otherwise. A failed RDT send falls back to RTM for a second,
+ * or until an RTM message goes undelivered. acb reports delivery of msg_id.
+ */
+int agora_msg_send(const void *msg, int msg_len, uint32_t msg_id);
+
+/* Messages sent but not yet delivered. */
+int agora_msg_backlog();
+
+/* Whether commands currently go over the RDT tunnel. */
+bool agora_msg_on_rdt();
+
 #endif /*__AGORA_H__*/
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __AGORA_SHIM_H__
+#define __AGORA_SHIM_H__
+#include "agora_rtc_api.h"
+#include "agora.h"
+
+/*
+ * SDK calls agora.cpp makes once connections are up. agora_init() uses the
+ * real SDK, agora_shim_init() lets a local stand-in replace it and drive the
+ * same event handlers without network or token service.
+ */
+typedef struct agora_sdk_ops {
+	int (*send_video_data)(connection_id_t conn_id, const void *data, size_t len,
+			video_frame_info_t *info);
+	int (*send_audio_data)(connection_id_t conn_id, const void *data, size_t len,
+			audio_frame_info_t *info);
+	int (*send_rdt_msg)(connection_id_t conn_id, uint32_t remote_uid, rdt_stream_type_e type,
+			const void *msg, size_t len);
+	int (*get_rdt_status_info)(connection_id_t conn_id, uint32_t remote_uid, rdt_status_info_t *info);
+	int (*send_rtm_data)(const char *rtm_uid, const void *msg, size_t msg_len, uint32_t msg_id);
+} agora_sdk_ops_t;
+
+int agora_shim_init(const agora_sdk_ops_t *ops, agora_connnected_cb_t ccb, agora_msg_cb_t mcb);
+
+const agora_rtc_event_handler_t *agora_shim_event_handler();
+
+const agora_rtm_handler_t *agora_shim_rtm_handler();
+
+#endif /*__AGORA_SHIM_H__*/
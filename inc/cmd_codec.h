@@ -0,0 +1,115 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __CMD_CODEC_H__
+#define __CMD_CODEC_H__
+
+#include <stdint.h>
+#include "st_dev.h"
+
+/*
+ * Binary command frame, little endian. A message may carry several frames
+ * back to back.
+ *
+ *   u8  magic (CMD_BIN_MAGIC)
+ *   u8  version (CMD_BIN_VERSION)
+ *   u8  flags (CMD_BIN_F_*)
+ *   u8  joint mask
+ *   u32 seq
+ *   u32 ts, sender clock in ms
+ *   u32 ref seq                        if CMD_BIN_F_DELTA
+ *   per masked joint:
+ *     s16 position                     or zigzag varint delta to ref seq if CMD_BIN_F_DELTA
+ *   per masked joint: u16 speed        if CMD_BIN_F_SPEED
+ *   per masked joint: u8 acc           if CMD_BIN_F_ACC
+ *
+ * A delta frame carries the changed joints only, the others keep the value
+ * they had in the ref frame. It must use the same SPEED/ACC flags as its ref.
+ */
+#define CMD_BIN_MAGIC		0xA5
+#define CMD_BIN_VERSION		1
+
+#define CMD_BIN_F_DELTA		0x01
+#define CMD_BIN_F_SPEED		0x02
+#define CMD_BIN_F_ACC		0x04
+
+#define CMD_BIN_MAX_LEN		(16 + ST_JOINT_NUMBER * 6)
+
+/*
+ * Frames a decoder keeps as delta references, by seq. The publisher refers
+ * to frames at most half of that old, which has to span the ack round trip:
+ * 640 ms at 200 Hz.
+ */
+#define CMD_HIST_SIZE		256
+
+#define CMD_LAYERS_MAX		8
+#define CMD_REASON_MAX		64
+
+typedef struct cmd_ref {
+	uint32_t	seq;
+	uint32_t	mask;
+	uint8_t		flags;
+	int16_t		pos[ST_JOINT_NUMBER];
+	uint16_t	speed[ST_JOINT_NUMBER];
+	uint8_t		acc[ST_JOINT_NUMBER];
+} cmd_ref_t;
+
+/* Per stream decoder state, the poses delta frames may refer to. Not thread safe. */
+typedef struct cmd_decoder {
+	cmd_ref_t	hist[CMD_HIST_SIZE];	/* slot seq % CMD_HIST_SIZE */
+} cmd_decoder_t;
+
+/* What a JSON message carries, see cmd_parse_json. */
+typedef enum cmd_json_kind {
+	CMD_JSON_ARM = 0,	/* arm command in cmd */
+	CMD_JSON_LAYERS,	/* viewer layout, layer_num masks in layers */
+	CMD_JSON_DUMP,		/* recorder trigger, reason */
+} cmd_json_kind_e;
+
+typedef struct cmd_json {
+	st_cmd_t	cmd;
+	uint32_t	layers[CMD_LAYERS_MAX];
+	int		layer_num;
+	char		reason[CMD_REASON_MAX];
+} cmd_json_t;
+
+typedef void (*cmd_handler_t)(const st_cmd_t *cmd);
+
+void cmd_decoder_init(cmd_decoder_t *dec);
+
+/*
+ * Decode a JSON arm command {"seq": n, "ts": ms, "angles": [...]} in place.
+ * msg does not need to be NUL terminated. No heap allocation is made.
+ * Returns 0 on success, -1 on malformed input, a wrong joint count or a
+ * seq, ts or angle out of range.
+ */
+int cmd_decode_json(const char *msg, int msg_len, st_cmd_t *cmd);
+
+/*
+ * Tokenize a JSON message once and decode whichever message it is:
+ *   {"layers": [m0, m1, ...]}  viewer layout, one HAL_LAYER_* mask per camera
+ *   {"dump": "reason"}         recorder trigger, reason truncated
+ *   anything else              arm command as in cmd_decode_json
+ * Returns the cmd_json_kind_e, -1 on malformed input.
+ */
+int cmd_parse_json(const char *msg, int msg_len, cmd_json_t *out);
+
+/*
+ * Decode one binary frame. Returns the number of bytes consumed, -1 on a
+ * malformed frame or a delta frame whose reference is unknown.
+ */
+int cmd_decode_bin(cmd_decoder_t *dec, const uint8_t *buf, int len, st_cmd_t *cmd);
+
+/*
+ * Encode cmd as a binary frame, as a delta to ref when ref is not NULL.
+ * Returns the frame length or -1 if buf is too small.
+ */
+int cmd_encode_bin(const st_cmd_t *cmd, const st_cmd_t *ref, uint8_t *buf, int buf_len);
+
+/*
+ * Decode a message carrying either JSON or binary frames and call cb for
+ * every command. Returns the number of commands decoded or -1.
+ */
+int cmd_decode(cmd_decoder_t *dec, const void *msg, int msg_len, cmd_handler_t cb);
+
+#endif /*__CMD_CODEC_H__*/
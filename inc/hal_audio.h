@@ -0,0 +1,25 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_AUDIO_H__
+#define __HAL_AUDIO_H__
+#include "hal_stream.h"
+
+typedef struct hal_audio_cfg {
+	const char	*device;	/* ALSA device, "pulse" for PulseAudio, "test" for audiotestsrc */
+	int		ch;		/* camera whose connection carries the audio */
+	int		frame_ms;	/* Opus frame, 10 or 20 */
+	int		buffer_ms;	/* capture buffer, also bounds the frames waiting to be sent */
+} hal_audio_cfg_t;
+
+/*
+ * Microphone uplink: capture, 48 kHz mono Opus, one frame per cb call with
+ * m_enc_type HET_OPUS, the configured camera's ch and pts in CLOCK_MONOTONIC us.
+ * Frames are delivered from a capture thread, a capture error restarts the
+ * pipeline after a second.
+ */
+int hal_audio_init(const hal_audio_cfg_t *cfg, hal_frame_cb_t cb);
+
+void hal_audio_final();
+
+#endif /*__HAL_AUDIO_H__*/
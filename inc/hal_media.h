@@ -36,22 +36,23 @@ typedef enum hal_enc_type {
 	HET_MAX
 } hal_enc_type_e;
 
+typedef enum hal_stream_type {
+	HST_UNKNOWN = 0,
+	HST_MAIN = 1,
+	HST_SUB = 2,
+	HST_MAX
+} hal_stream_type_e;
+
 typedef struct hal_frame {
 	hal_enc_type_e		m_enc_type;
 	hal_frame_type_e	m_frame_type;
 	uint8_t			*m_data;
 	uint32_t		m_len;
-	uint64_t		pts;
+	uint64_t		pts;	/* capture time, CLOCK_MONOTONIC us, 0 if unknown */
 	uint64_t		dts;
+	hal_stream_type_e	m_stream_type;	/* simulcast layer, HST_MAIN without simulcast */
 } hal_frame_t;
 
-typedef enum hal_stream_type {
-	HST_UNKNOWN = 0,
-	HST_MAIN = 1,
-	HST_SUB = 2,
-	HST_MAX
-} hal_stream_type_e;
-
 typedef struct hal_stream {
 	hal_frame_t		m_frame;
 	uint8_t			m_chn;
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_NAL_H__
+#define __HAL_NAL_H__
+#include <stdint.h>
+#include "hal_media.h"
+
+#define H264_NAL_SLICE	1
+#define H264_NAL_IDR	5
+#define H264_NAL_SEI	6
+#define H264_NAL_SPS	7
+#define H264_NAL_PPS	8
+#define H264_NAL_AUD	9
+
+/* H.265 type is (byte >> 1) & 0x3f, types 16..21 are random access points. */
+#define H265_NAL_BLA_W_LP	16
+#define H265_NAL_IDR_W_RADL	19
+#define H265_NAL_IDR_N_LP	20
+#define H265_NAL_CRA		21
+#define H265_NAL_VPS		32
+#define H265_NAL_SPS		33
+#define H265_NAL_PPS		34
+#define H265_NAL_AUD		35
+
+typedef struct hal_nal {
+	const uint8_t	*data;		/* start code included */
+	uint32_t	len;
+	uint8_t		type;
+} hal_nal_t;
+
+/* Annex-B access unit summary, pointers refer into the parsed buffer. */
+typedef struct hal_au_info {
+	bool		key;		/* contains an IDR slice, or an IRAP picture for H.265 */
+	const uint8_t	*payload;	/* AU without leading AUD */
+	uint32_t	payload_len;
+	hal_nal_t	vps;		/* H.265 only */
+	hal_nal_t	sps;		/* len 0 when absent */
+	hal_nal_t	pps;
+	int		nal_count;
+} hal_au_info_t;
+
+/*
+ * Find the next 3 or 4 byte start code in [p, end), scanning a word at a
+ * time. Returns its position or end, *sc_len gets its length.
+ */
+const uint8_t *hal_nal_find_start(const uint8_t *p, const uint8_t *end, int *sc_len);
+
+/*
+ * Walk all NAL units of an Annex-B access unit, enc is HET_H264 or HET_H265.
+ * Returns -1 if none is found.
+ */
+int hal_nal_parse_au(const uint8_t *buf, uint32_t len, hal_enc_type_e enc, hal_au_info_t *info);
+
+#endif /*__HAL_NAL_H__*/
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_REC_H__
+#define __HAL_REC_H__
+#include <stdint.h>
+#include "hal_media.h"
+#include "st_dev.h"
+
+typedef struct _GstBuffer GstBuffer;
+
+/*
+ * In-memory flight recorder: the last seconds of every camera's encoded
+ * stream, starting on an IDR, and the arm commands received in that time.
+ * A trigger writes them out on a background thread:
+ *   <dir>/rec-<date>-camera<N>.h264 (or .h265), Annex-B
+ *   <dir>/rec-<date>.log, frames and commands interleaved by time
+ * Disabled until hal_rec_init, the other calls are then no-ops.
+ */
+int hal_rec_init(int seconds, const char *dir);
+
+/*
+ * Keeps a reference to an encoded access unit, pts_us is CLOCK_MONOTONIC.
+ * Buffers from a pool are swapped for copies by the writer thread so the
+ * encoder never runs dry; a camera waiting on too many of them skips frames
+ * up to its next IDR.
+ */
+void hal_rec_push_video(int ch, hal_enc_type_e enc, GstBuffer *buffer, uint64_t pts_us, bool key);
+
+void hal_rec_log_cmd(const st_cmd_t *cmd);
+
+/* Dump what is recorded now. Returns -1 when disabled or a dump is still being written. */
+int hal_rec_trigger(const char *reason);
+
+void hal_rec_final();
+
+#endif /*__HAL_REC_H__*/
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_SHM_H__
+#define __HAL_SHM_H__
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Frame ring in POSIX shared memory, one writer, any number of readers.
+ * Layout: hal_shm_hdr_t, then `slots` slots of slot_stride bytes, each a
+ * hal_shm_frame_t padded to HAL_SHM_META_SIZE followed by the frame data.
+ * Frame n goes to slot n % slots. Every slot is a seqlock: seq is odd while
+ * the writer fills it, so a reader takes seq, uses the data in place and
+ * checks seq again, the frame is only valid if it didn't change.
+ * Readers map the object read-only and never block the writer.
+ */
+#define HAL_SHM_MAGIC		0x4d524653	/* "SFRM" */
+#define HAL_SHM_VERSION		1
+#define HAL_SHM_META_SIZE	64
+#define HAL_SHM_FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+typedef struct hal_shm_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	slots;
+	uint32_t	slot_size;	/* data bytes per slot */
+	uint32_t	slot_stride;	/* bytes from one slot to the next */
+	uint32_t	hdr_size;	/* offset of slot 0 */
+	uint64_t	head;		/* newest complete frame, 0 before the first */
+	uint64_t	dropped;	/* frames larger than slot_size */
+} hal_shm_hdr_t;
+
+typedef struct hal_shm_frame {
+	uint32_t	seq;
+	uint32_t	len;
+	uint64_t	frame_no;
+	uint64_t	pts_us;		/* capture time, CLOCK_MONOTONIC */
+	uint32_t	enc;		/* hal_enc_type_e, HET_UNKNOWN for raw video */
+	uint32_t	fourcc;		/* raw video format, e.g. NV12 */
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	stride[2];	/* raw video: luma and chroma plane */
+	uint32_t	offset[2];
+	uint32_t	key;		/* encoded: IDR with parameter sets */
+} hal_shm_frame_t;
+
+typedef struct hal_shm_ring hal_shm_ring_t;
+
+/* Writer side. Creates (or replaces) /name, returns NULL on failure. */
+hal_shm_ring_t *hal_shm_create(const char *name, uint32_t slots, uint32_t slot_size);
+
+/* Publishes one frame, meta's seq, len and frame_no are filled in here. */
+int hal_shm_write(hal_shm_ring_t *ring, const hal_shm_frame_t *meta, const void *data, uint32_t len);
+
+/* Unmaps and unlinks, readers keep their mapping until they detach. */
+void hal_shm_destroy(hal_shm_ring_t *ring);
+
+/* Reader side. */
+const hal_shm_hdr_t *hal_shm_attach(const char *name);
+
+void hal_shm_detach(const hal_shm_hdr_t *hdr);
+
+/* Newest frame and its seq, NULL when there is none or it is being rewritten. */
+const hal_shm_frame_t *hal_shm_latest(const hal_shm_hdr_t *hdr, uint32_t *seq);
+
+const uint8_t *hal_shm_data(const hal_shm_frame_t *frame);
+
+/* True when the frame read since hal_shm_latest wasn't overwritten meanwhile. */
+bool hal_shm_valid(const hal_shm_frame_t *frame, uint32_t seq);
+
+#endif /*__HAL_SHM_H__*/
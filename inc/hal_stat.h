@@ -0,0 +1,29 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_STAT_H__
+#define __HAL_STAT_H__
+#include <stdint.h>
+
+/* Bucket i counts samples in [2^i, 2^(i+1)) us, the last one everything above. */
+#define HAL_HIST_BUCKETS 24
+
+typedef struct hal_hist {
+	uint32_t	bucket[HAL_HIST_BUCKETS];
+	uint32_t	count;
+	uint64_t	sum_us;
+	uint32_t	max_us;
+} hal_hist_t;
+
+void hal_hist_reset(hal_hist_t *hist);
+
+void hal_hist_add(hal_hist_t *hist, uint32_t us);
+
+/* Upper bound of the bucket holding the pct-th percentile, in us. */
+uint32_t hal_hist_percentile(const hal_hist_t *hist, int pct);
+
+void hal_hist_print(const char *name, const hal_hist_t *hist);
+
+uint64_t hal_now_us();
+
+#endif /*__HAL_STAT_H__*/
@@ -7,16 +7,128 @@
 
 #include "hal_media.h"
 
+#define HAL_CAMERA_MAX	3
+
+/* Simulcast layers, see media_device_set_layers. */
+#define HAL_LAYER_HIGH	0x01
+#define HAL_LAYER_LOW	0x02
+
+/* Shared memory export, see media_device_set_export. */
+#define HAL_EXPORT_RAW		0x01
+#define HAL_EXPORT_ENCODED	0x02
+
 typedef void (*hal_frame_cb_t)(int ch, hal_frame_t *frame, const void *ctx);
 
+typedef struct hal_camera_cfg {
+	char	device[128];	/* v4l2 capture device, "test" for videotestsrc */
+	int	width;
+	int	height;
+	int	fps;
+	char	capture[16];	/* "mjpeg", "hwjpeg", "raw", empty or "auto" to probe */
+	char	encoder[32];	/* encoder element, empty to probe */
+	hal_enc_type_e codec;	/* HET_H264 or HET_H265 */
+	int	priority;	/* share of the uplink budget */
+} hal_camera_cfg_t;
+
+/*
+ * Selects the cameras, call before media_device_init.
+ * cfg_file: one camera per line, "device width height fps [capture [encoder [priority]]]",
+ * "auto" in the capture or encoder column probes, "h264" or "h265" in the
+ * encoder column probes for that codec, an encoder element implies its codec,
+ * a device name without '/' is looked up in /dev/v4l/by-id.
+ * Without a file the capture devices found in /dev/v4l/by-id are used at 640x480@30.
+ * test_src > 0 uses that many videotestsrc cameras instead.
+ * The encoder is probed in the order v4l2h264enc, vaapih264enc, x264enc, or
+ * v4l2h265enc, vaapih265enc, x265enc, the capture path in the order hwjpeg,
+ * raw, mjpeg. An H.265 camera without any H.265 encoder falls back to H.264.
+ */
+int media_device_config(const char *cfg_file, int test_src);
+
+/* Codec of cameras whose config doesn't name one, HET_H264 by default. Call before media_device_config. */
+void media_device_set_codec(hal_enc_type_e codec);
+
+/*
+ * Runs every capture path each configured camera supports for the given
+ * seconds and prints frame rate, bitrate and process CPU per variant.
+ * Call after media_device_config, instead of media_device_init.
+ */
+int media_device_bench(int seconds);
+
 int media_device_init(hal_frame_cb_t cb);
 
 void meida_device_final();
 
+/*
+ * The camera's connection joined. Its pipeline plays while the connection has
+ * viewers, is PAUSED when the last one leaves and READY after the idle grace
+ * period. State changes are asynchronous.
+ */
 int media_device_start(int ch, const void *ctx);
 
 int media_device_stop(int ch);
 
 int media_device_stop_all();
+
+/* Remote viewer count of the camera's connection. */
+int media_device_set_viewers(int ch, int viewers);
+
+/* Seconds a pipeline stays PAUSED without viewers, -1 keeps it playing. Default 30. */
+void media_device_set_idle_grace(int grace_s);
+
+/*
+ * Call before media_device_init. Pre-rolled pipelines play at init until the
+ * first encoded frame, then idle in PAUSED instead of READY, so a viewer only
+ * waits for the forced IDR.
+ */
+void media_device_set_preroll(bool preroll);
+
+/*
+ * Call before media_device_init. HAL_EXPORT_RAW publishes every camera's
+ * decoded frames as NV12 in the shared memory ring /camera<N>-raw and keeps
+ * the camera playing without viewers, HAL_EXPORT_ENCODED its high layer
+ * access units in /camera<N>-enc. Rings are described in hal_shm.h. In
+ * mosaic mode only the mosaic's encoded stream is exported, as /camera0-enc.
+ */
+void media_device_set_export(int mode);
+
+/*
+ * Call before media_device_init. Every camera also encodes a half-size
+ * layer at a low fixed bitrate, delivered with m_stream_type HST_SUB.
+ * Ignored in mosaic mode.
+ */
+void media_device_set_simulcast(bool simulcast);
+
+/*
+ * Call before media_device_init, NULL keeps one stream per camera. Otherwise
+ * all cameras are composited into one 1280x720 frame, encoded once and
+ * delivered as camera 0. layout is "main" (camera 0 large, others on the
+ * right), "grid", "row", or one "x:y:w:h" rectangle per camera separated by
+ * ',', cameras without a rectangle are left out. Returns -1 on a bad layout.
+ */
+int media_device_set_mosaic(const char *layout);
+
+/*
+ * Force an IDR on one layer of the camera, HST_MAIN or HST_SUB. Rate limited
+ * per layer, returns 1 when the request was suppressed.
+ */
+int media_device_request_key_frame(int ch, hal_stream_type_e type);
+
+/*
+ * Network target for the camera's connection. The sum over all cameras is
+ * split by priority and applied to the encoders with hysteresis.
+ */
+int media_device_set_target_bitrate(int ch, uint32_t bps);
+
+/* Relative share of the uplink budget, camera 0 defaults to 2, others to 1. */
+int media_device_set_priority(int ch, uint32_t priority);
+
+/*
+ * HAL_LAYER_* mask of the layers the viewers want from the camera, both by
+ * default. The mask is per camera, it applies to every viewer of it. With
+ * simulcast the high layer is also dropped while the camera's share of the
+ * uplink is too small for it, without simulcast a mask lacking
+ * HAL_LAYER_HIGH is rejected with -1.
+ */
+int media_device_set_layers(int ch, uint32_t layers);
 #endif /*__HAL_STREAM_H__*/
 
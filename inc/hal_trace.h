@@ -0,0 +1,30 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __HAL_TRACE_H__
+#define __HAL_TRACE_H__
+#include <stdint.h>
+
+typedef struct _GstElement GstElement;
+
+/*
+ * Per-element latency tracing of the camera pipelines. Every element with one
+ * "sink" and one "src" pad gets a buffer probe on both; a buffer is matched by
+ * PTS and its time inside the element and the number of buffers still inside
+ * when it leaves go into per-camera histograms.
+ * Nothing is installed until hal_trace_enable, the other calls are then no-ops.
+ */
+void hal_trace_enable();
+
+bool hal_trace_enabled();
+
+/* Probes the elements of a pipeline for camera ch. Returns the element count, -1 when disabled. */
+int hal_trace_attach(int ch, GstElement *pipeline);
+
+/* Removes the probes, call with the pipeline stopped. */
+void hal_trace_detach(int ch);
+
+/* Prints one line per element and starts new histograms. */
+void hal_trace_print(int ch);
+
+#endif /*__HAL_TRACE_H__*/
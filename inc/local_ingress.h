@@ -0,0 +1,21 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __LOCAL_INGRESS_H__
+#define __LOCAL_INGRESS_H__
+
+typedef void (*local_msg_cb_t)(const char *msg, int msg_len);
+
+/*
+ * Accept command datagrams from co-located controllers on a UDP port and/or
+ * an abstract Unix datagram socket. All sockets are serviced by one epoll
+ * thread. udp_port <= 0 or an empty unix_name disables that socket.
+ * Commands are not authenticated, udp_addr is the IPv4 address the UDP
+ * socket binds to: 127.0.0.1 for this host, a LAN interface's address for
+ * controllers on that network only.
+ */
+int local_ingress_init(const char *udp_addr, int udp_port, const char *unix_name, local_msg_cb_t cb);
+
+void local_ingress_final();
+
+#endif /*__LOCAL_INGRESS_H__*/
@@ -1,15 +1,67 @@
 /*
  * Copyright 2023 Ethan. All rights reserved.
  */
-#ifndef _ST_DEV_H__
+#ifndef __ST_DEV_H__
 #define __ST_DEV_H__
 
-#include <vector>
+#include <stdint.h>
 #include <string>
 
+#define ST_JOINT_NUMBER 6
+
+#define ST_CMD_F_SPEED	0x01	/* speed[] valid for masked joints */
+#define ST_CMD_F_ACC	0x02	/* acc[] valid for masked joints */
+
+/*
+ * One arm setpoint. seq and ts come from the sender, 0 means "not provided":
+ * an unsequenced command is never treated as reordered and a command without
+ * timestamp is never treated as late.
+ */
+typedef struct st_cmd {
+	uint32_t	seq;
+	uint32_t	ts;		/* sender clock, ms */
+	uint32_t	mask;		/* bit i set when pos[i] is valid */
+	uint32_t	flags;		/* ST_CMD_F_* */
+	int16_t		pos[ST_JOINT_NUMBER];
+	uint16_t	speed[ST_JOINT_NUMBER];
+	uint8_t		acc[ST_JOINT_NUMBER];
+} st_cmd_t;
+
+/*
+ * Senders keep separate seq, clock and queue state, so they can be
+ * interleaved. Each tick executes the newest setpoint due from any of them.
+ */
+typedef enum st_cmd_src {
+	ST_SRC_CLOUD = 0,	/* RDT or RTM */
+	ST_SRC_LOCAL,		/* local ingress */
+	ST_SRC_NUM
+} st_cmd_src_e;
+
+typedef struct st_device_stats {
+	uint32_t	received;
+	uint32_t	executed;
+	uint32_t	dropped;	/* superseded by a newer setpoint or buffer overflow */
+	uint32_t	late;		/* older than max_age_ms when received or played */
+	uint32_t	reordered;	/* seq not newer than the last accepted one */
+	uint32_t	jitter_ms;	/* current arrival jitter estimate, the worst source's */
+	uint32_t	playout_ms;	/* current jitter buffer delay, the longest source's */
+} st_device_stats_t;
+
 int st_device_init(std::string dev_name);
 
-int st_device_ctl(std::vector<int> angles);
+int st_device_ctl(st_cmd_src_e from, const st_cmd_t *cmd);
+
+/*
+ * playout_ms: target jitter buffer delay, 0 disables the buffer and the
+ * newest setpoint is executed on every tick.
+ * max_age_ms: setpoints older than this (relative to the fastest observed
+ * transit) are dropped, 0 disables the check.
+ * Returns -1 when playout_ms isn't below max_age_ms; the buffer delay is
+ * kept one control tick below max_age_ms.
+ */
+int st_device_set_playout(int playout_ms, int max_age_ms);
+
+void st_device_get_stats(st_device_stats_t *stats);
 
 void st_device_final();
 #endif /*__ST_DEV_H__*/
@@ -0,0 +1,24 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __ST_LEADER_H__
+#define __ST_LEADER_H__
+
+#include "ST/SCServo.h"
+#include "st_dev.h"
+
+/* A hand-moved leader arm, torque off, read with sync-read. */
+typedef struct st_leader {
+	SMS_STS		sm_st;
+	uint8_t		id[ST_JOINT_NUMBER];
+	uint32_t	read_errors;
+} st_leader_t;
+
+int st_leader_open(st_leader_t *leader, const char *dev_name);
+
+/* Read present positions, returns the mask of joints that answered. */
+uint32_t st_leader_read(st_leader_t *leader, int16_t pos[ST_JOINT_NUMBER]);
+
+void st_leader_close(st_leader_t *leader);
+
+#endif /*__ST_LEADER_H__*/
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __ST_MIRROR_H__
+#define __ST_MIRROR_H__
+
+/*
+ * Local leader-follower teleoperation: sync-read the leader arm, map every
+ * joint and sync-write the follower arm in one loop at rate_hz.
+ *
+ * map_file (optional) has one line per joint, '#' starts a comment:
+ *   <joint 0..5> <offset> <invert 0|1> <scale>
+ * follower = 2048 + (invert ? -1 : 1) * scale * (leader - 2048) + offset
+ */
+int st_mirror_init(const char *leader_dev, const char *follower_dev, const char *map_file, int rate_hz);
+
+void st_mirror_final();
+
+#endif /*__ST_MIRROR_H__*/
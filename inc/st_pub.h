@@ -0,0 +1,27 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#ifndef __ST_PUB_H__
+#define __ST_PUB_H__
+
+#include <stdint.h>
+
+/*
+ * Leader arm publisher: sample the leader at rate_hz, quantize positions to
+ * multiples of quant, and send binary command frames through
+ * agora_msg_send(). Unchanged samples are skipped, changed joints are delta
+ * encoded against the last delivered frame. Over RDT several samples are
+ * batched per message so that at most msg_rate messages per second are sent;
+ * on either transport batches grow while the link reports a backlog.
+ */
+int st_pub_init(const char *leader_dev, int rate_hz, int quant, int msg_rate);
+
+/* agora_ack_cb_t for agora_set_role(). */
+void st_pub_ack(uint32_t msg_id, bool delivered);
+
+/* agora_path_cb_t, leaving RDT drops the reference and sends a full frame. */
+void st_pub_path(bool rdt);
+
+void st_pub_final();
+
+#endif /*__ST_PUB_H__*/
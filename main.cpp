@@ -3,52 +3,114 @@
  */
 
 #include <iostream>
+#include <mutex>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <cjson/cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include "ST/SCServo.h"
 #include "hal_stream.h"
+#include "hal_rec.h"
+#include "hal_trace.h"
+#include "hal_audio.h"
 #include "agora.h"
 #include "st_dev.h"
+#include "cmd_codec.h"
+#include "local_ingress.h"
+#include "st_mirror.h"
+#include "st_pub.h"
 
 volatile static bool b_exit = false;
+static cmd_decoder_t g_cmd_dec;
+static cmd_decoder_t g_local_dec;
+static std::mutex g_cmd_mtx;
+
+volatile static bool b_dump = false;
 
 static void signal_handler(int sig)
 {
 	b_exit = true;
 }
 
+static void dump_handler(int sig)
+{
+	b_dump = true;
+}
+
 static void hal_frame_cb(int ch, hal_frame_t *frame, const void *ctx)
 {
 //	printf("hal_frame_cb len[%d] is_key[%d]\n", frame->m_len, frame->m_frame_type);
-	agora_frame_send(ch + 1, frame);
+	if (frame->m_enc_type == HET_OPUS)
+		agora_audio_send(ch + 1, frame);
+	else
+		agora_frame_send(ch + 1, frame);
 }
 
-static void agora_msg_cb(const char *msg, int msg_len)
+static void st_cmd_cb(const st_cmd_t *cmd)
 {
-	printf("agora_msg_cb msg[%s] len[%d]\n", msg, msg_len);
+	hal_rec_log_cmd(cmd);
+	st_device_ctl(ST_SRC_CLOUD, cmd);
+}
 
-	cJSON *json = cJSON_Parse((char*)msg);
-	if (!json) {
-		printf("cJSON_Parse error.\n");
-		return ;
+static void st_local_cmd_cb(const st_cmd_t *cmd)
+{
+	hal_rec_log_cmd(cmd);
+	st_device_ctl(ST_SRC_LOCAL, cmd);
+}
+
+/* RTM and RDT messages may arrive on different SDK threads and share delta refs. */
+static void agora_msg_cb(const char *msg, int msg_len)
+{
+	if (msg_len > 0 && (uint8_t)msg[0] == CMD_BIN_MAGIC) {
+		std::lock_guard<std::mutex> lg(g_cmd_mtx);
+		if (cmd_decode(&g_cmd_dec, msg, msg_len, st_cmd_cb) < 0)
+			printf("agora_msg_cb bad command len[%d]\n", msg_len);
+		return;
 	}
 
-	std::vector<int> angles;
-	cJSON *json_angles = cJSON_GetObjectItem(json, "angles");
+	cmd_json_t js;
+	switch (cmd_parse_json(msg, msg_len, &js)) {
+	case CMD_JSON_LAYERS:
+		for (int i = 0; i < js.layer_num && i < HAL_CAMERA_MAX; i++)
+			media_device_set_layers(i, js.layers[i]);
+		break;
+	case CMD_JSON_DUMP:
+		hal_rec_trigger(js.reason);
+		break;
+	case CMD_JSON_ARM: {
+		std::lock_guard<std::mutex> lg(g_cmd_mtx);
+		st_cmd_cb(&js.cmd);
+		break;
+	}
+	default:
+		printf("agora_msg_cb bad command len[%d]\n", msg_len);
+		break;
+	}
+}
 
-	cJSON *json_angle;
-	cJSON_ArrayForEach(json_angle, json_angles) {
-		if (cJSON_IsNumber(json_angle)) {
-			angles.push_back(json_angle->valueint);
-		}
+static void local_msg_cb(const char *msg, int msg_len)
+{
+	if (cmd_decode(&g_local_dec, msg, msg_len, st_local_cmd_cb) < 0) {
+		printf("local_msg_cb bad command len[%d]\n", msg_len);
 	}
+}
+
+static void agora_key_frame_cb(int conn_id, bool low)
+{
+	media_device_request_key_frame(conn_id - 1, low ? HST_SUB : HST_MAIN);
+}
 
-	st_device_ctl(angles);
+static void agora_bitrate_cb(int conn_id, uint32_t target_bps)
+{
+	media_device_set_target_bitrate(conn_id - 1, target_bps);
+}
 
-	cJSON_Delete(json);
+static void agora_viewer_cb(int conn_id, int viewers)
+{
+	media_device_set_viewers(conn_id - 1, viewers);
 }
 
 static void agora_conn_cb(int uid)
@@ -57,31 +119,312 @@ static void agora_conn_cb(int uid)
 	media_device_start(uid % 1000, NULL);
 }
 
-int main(int argc, const char *argv[]) 
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <serial> <room>\n", prog);
+	printf("       %s --mirror <leader serial> [options] <follower serial> [room]\n", prog);
+	printf("       %s --publish <leader serial> [options] <room>\n", prog);
+	printf("  --playout MS   jitter buffer target delay for timestamped commands (0: off)\n");
+	printf("  --max-age MS   drop commands delayed more than MS (0: off)\n");
+	printf("  --udp PORT     also accept commands on local UDP port\n");
+	printf("  --udp-bind ADDR address the --udp socket binds to (default 127.0.0.1)\n");
+	printf("  --unix NAME    also accept commands on abstract unix datagram socket @NAME\n");
+	printf("  --mirror DEV   mirror the leader arm on DEV to the follower arm locally\n");
+	printf("  --map FILE     per-joint leader to follower mapping for --mirror\n");
+	printf("  --rate HZ      leader sampling rate (default 200, at most 256 with --publish)\n");
+	printf("  --publish DEV  publish the leader arm on DEV to the room's arm\n");
+	printf("  --quant N      --publish position quantization step (default 4)\n");
+	printf("  --msg-rate N   --publish messages per second over RDT before batching (default 50),\n");
+	printf("                 RTM sends every sample at once until the link lags\n");
+	printf("  --cameras FILE camera config, one \"device width height fps [capture [encoder [priority]]]\" per line\n");
+	printf("  --test-src N   stream N videotestsrc cameras instead of real ones\n");
+	printf("  --idle-grace SEC keep a camera paused this long without viewers before releasing it,\n");
+	printf("                 -1 streams regardless of viewers (default 30)\n");
+	printf("  --preroll      open and warm up all cameras at startup for a fast first frame\n");
+	printf("  --h265         encode cameras without a configured codec as H.265\n");
+	printf("  --mosaic LAYOUT composite all cameras into one 1280x720 stream on one connection,\n");
+	printf("                 LAYOUT is main, grid, row or x:y:w:h,... per camera\n");
+	printf("  --simulcast    also send a half-size low bitrate stream per camera\n");
+	printf("  --record SEC   keep the last SEC seconds of video and commands, dumped on SIGUSR1,\n");
+	printf("                 a {\"dump\": \"reason\"} command or a camera fault\n");
+	printf("  --record-dir DIR where --record dumps go (default .)\n");
+	printf("  --audio DEV    send the microphone as Opus on camera 0's connection, DEV is an ALSA\n");
+	printf("                 device, pulse or test\n");
+	printf("  --audio-frame MS Opus frame length, 10 or 20 (default 10)\n");
+	printf("  --audio-buffer MS capture buffer and send backlog limit (default 40)\n");
+	printf("  --export MODE  publish frames to local processes in shared memory, MODE is raw\n");
+	printf("                 (NV12, /cameraN-raw), encoded (/cameraN-enc) or both\n");
+	printf("  --trace        print per-element pipeline latency and queue depth every 10 s\n");
+	printf("  --bench SEC    run each camera capture path for SEC seconds, print fps and CPU, exit\n");
+}
+
+int main(int argc, char *argv[]) 
 {
 	int ret = 0;
-	if (argc < 2) {
-		printf("argc error! Please provide the serial port as an argument.\n");
-		return 1;
+	int playout_ms = 0;
+	int max_age_ms = 0;
+	int udp_port = 0;
+	const char *udp_addr = "127.0.0.1";
+	const char *unix_name = NULL;
+	const char *mirror_dev = NULL;
+	const char *map_file = NULL;
+	int rate_hz = 200;
+	const char *publish_dev = NULL;
+	int quant = 4;
+	int msg_rate = 50;
+	const char *camera_cfg = NULL;
+	int test_src = 0;
+	int bench_s = 0;
+	int idle_grace_s = 30;
+	bool preroll = false;
+	bool simulcast = false;
+	bool h265 = false;
+	const char *mosaic = NULL;
+	int record_s = 0;
+	const char *record_dir = ".";
+	int export_mode = 0;
+	hal_audio_cfg_t audio_cfg = { NULL, 0, 10, 40 };
+
+	static const struct option long_opts[] = {
+		{"playout", required_argument, NULL, 'p'},
+		{"max-age", required_argument, NULL, 'a'},
+		{"udp", required_argument, NULL, 'u'},
+		{"udp-bind", required_argument, NULL, 'U'},
+		{"unix", required_argument, NULL, 'x'},
+		{"mirror", required_argument, NULL, 'm'},
+		{"map", required_argument, NULL, 'M'},
+		{"rate", required_argument, NULL, 'r'},
+		{"publish", required_argument, NULL, 'P'},
+		{"quant", required_argument, NULL, 'q'},
+		{"msg-rate", required_argument, NULL, 'R'},
+		{"cameras", required_argument, NULL, 'c'},
+		{"test-src", required_argument, NULL, 't'},
+		{"bench", required_argument, NULL, 'b'},
+		{"idle-grace", required_argument, NULL, 'i'},
+		{"preroll", no_argument, NULL, 'w'},
+		{"simulcast", no_argument, NULL, 's'},
+		{"h265", no_argument, NULL, 'H'},
+		{"mosaic", required_argument, NULL, 'C'},
+		{"record", required_argument, NULL, 'e'},
+		{"record-dir", required_argument, NULL, 'E'},
+		{"trace", no_argument, NULL, 'T'},
+		{"export", required_argument, NULL, 'X'},
+		{"audio", required_argument, NULL, 'A'},
+		{"audio-frame", required_argument, NULL, 'F'},
+		{"audio-buffer", required_argument, NULL, 'B'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			playout_ms = atoi(optarg);
+			break;
+		case 'a':
+			max_age_ms = atoi(optarg);
+			break;
+		case 'u':
+			udp_port = atoi(optarg);
+			break;
+		case 'U':
+			udp_addr = optarg;
+			break;
+		case 'x':
+			unix_name = optarg;
+			break;
+		case 'm':
+			mirror_dev = optarg;
+			break;
+		case 'M':
+			map_file = optarg;
+			break;
+		case 'r':
+			rate_hz = atoi(optarg);
+			break;
+		case 'P':
+			publish_dev = optarg;
+			break;
+		case 'q':
+			quant = atoi(optarg);
+			break;
+		case 'R':
+			msg_rate = atoi(optarg);
+			break;
+		case 'c':
+			camera_cfg = optarg;
+			break;
+		case 't':
+			test_src = atoi(optarg);
+			break;
+		case 'b':
+			bench_s = atoi(optarg);
+			break;
+		case 'i':
+			idle_grace_s = atoi(optarg);
+			break;
+		case 'w':
+			preroll = true;
+			break;
+		case 's':
+			simulcast = true;
+			break;
+		case 'H':
+			h265 = true;
+			break;
+		case 'C':
+			mosaic = optarg;
+			break;
+		case 'e':
+			record_s = atoi(optarg);
+			break;
+		case 'E':
+			record_dir = optarg;
+			break;
+		case 'T':
+			hal_trace_enable();
+			break;
+		case 'X':
+			if (strcmp(optarg, "raw") == 0) {
+				export_mode = HAL_EXPORT_RAW;
+			} else if (strcmp(optarg, "encoded") == 0) {
+				export_mode = HAL_EXPORT_ENCODED;
+			} else if (strcmp(optarg, "both") == 0) {
+				export_mode = HAL_EXPORT_RAW | HAL_EXPORT_ENCODED;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'A':
+			audio_cfg.device = optarg;
+			break;
+		case 'F':
+			audio_cfg.frame_ms = atoi(optarg);
+			break;
+		case 'B':
+			audio_cfg.buffer_ms = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
 	signal(SIGINT, signal_handler);
 
-	std::cout << "Serial: " << argv[1] << std::endl;
+	if (h265)
+		media_device_set_codec(HET_H265);
+
+	if (bench_s > 0) {
+		if (media_device_config(camera_cfg, test_src) < 0)
+			return 1;
+		return media_device_bench(bench_s);
+	}
+
+	if (publish_dev) {
+		if (argc - optind < 1) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		agora_set_role(AGORA_ROLE_LEADER, st_pub_ack);
+		agora_set_path_cb(st_pub_path);
+		if (agora_init(argv[optind], NULL, NULL) < 0)
+			return 1;
+
+		if (st_pub_init(publish_dev, rate_hz, quant, msg_rate) < 0) {
+			agora_final();
+			return 1;
+		}
+
+		while (!b_exit) {
+			usleep(1000 * 1000);
+		}
+
+		st_pub_final();
+		agora_final();
+		return 0;
+	}
+
+	if (argc - optind < (mirror_dev ? 1 : 2)) {
+		printf("argc error! Please provide the serial port and room as arguments.\n");
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *serial = argv[optind];
+	const char *room = (argc - optind > 1) ? argv[optind + 1] : NULL;
+
+	std::cout << "Serial: " << serial << std::endl;
 
-	st_device_init(argv[1]);
+	if (mirror_dev) {
+		if (st_mirror_init(mirror_dev, serial, map_file, rate_hz) < 0)
+			return 1;
+	} else {
+		cmd_decoder_init(&g_cmd_dec);
+		cmd_decoder_init(&g_local_dec);
+		st_device_init(serial);
+		if (st_device_set_playout(playout_ms, max_age_ms) < 0)
+			return 1;
 
-	media_device_init(hal_frame_cb);
-	
-	agora_init(argv[2], agora_conn_cb, agora_msg_cb);
+		if (udp_port > 0 || unix_name)
+			local_ingress_init(udp_addr, udp_port, unix_name, local_msg_cb);
+	}
+
+	if (record_s > 0 && !mirror_dev) {
+		hal_rec_init(record_s, record_dir);
+		signal(SIGUSR1, dump_handler);
+	}
+
+	/* In mirror mode the room is optional and only carries video. */
+	if (room) {
+		if (media_device_config(camera_cfg, test_src) < 0)
+			return 1;
+		media_device_set_idle_grace(idle_grace_s);
+		media_device_set_preroll(preroll);
+		media_device_set_simulcast(simulcast);
+		media_device_set_export(export_mode);
+		if (mosaic) {
+			if (media_device_set_mosaic(mosaic) < 0)
+				return 1;
+			agora_set_conn_num(1);
+		}
+		media_device_init(hal_frame_cb);
+		if (audio_cfg.device && hal_audio_init(&audio_cfg, hal_frame_cb) < 0)
+			return 1;
+
+		agora_set_key_frame_cb(agora_key_frame_cb);
+		agora_set_bitrate_cb(agora_bitrate_cb);
+		agora_set_viewer_cb(agora_viewer_cb);
+		agora_init(room, agora_conn_cb, agora_msg_cb);
+	}
 
 	while (!b_exit) {
 		usleep(1000 * 1000);
+		if (b_dump) {
+			b_dump = false;
+			hal_rec_trigger("SIGUSR1");
+		}
+	}
+
+	if (mirror_dev) {
+		st_mirror_final();
+	} else {
+		local_ingress_final();
+	}
+
+	if (room) {
+		hal_audio_final();
+		agora_final();
+		meida_device_final();
 	}
 
-	agora_final();
+	hal_rec_final();
 
-	st_device_final();
+	if (!mirror_dev)
+		st_device_final();
 
 	return ret;
 }
@@ -2,26 +2,98 @@
  * Copyright 2023 Ethan. All rights reserved.
  */
 #include "agora.h"
-#include "agora_rtc_api.h"
+#include "agora_shim.h"
 #include <string>
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
 #include <cjson/cJSON.h>
 #include <curl/curl.h>
 
 #define MAX_CHN_NUM 3
+#define ARM_UID_BASE 1000
+#define LEADER_UID 2000
+/* Remote users tracked per connection, further ones are not counted. */
+#define VIEWER_MAX 16
+/* High and low simulcast stream. */
+#define LAYER_NUM 2
+/* A target below 1/SEND_COLLAPSE_DIV of the previous one is a collapse. */
+#define SEND_COLLAPSE_DIV 2
+/* Repeat the key frame request while still waiting for an IDR after this long. */
+#define SEND_KEY_RETRY_MS 1000
+/* After a failed RDT send, commands stay on RTM this long before RDT is tried again. */
+#define RDT_RETRY_MS 1000
+
+typedef enum cmd_path {
+	CMD_PATH_RTM = 0,
+	CMD_PATH_RDT,
+} cmd_path_e;
+
+static const char *g_cmd_path_name[] = {"rtm", "rdt"};
+
+typedef enum send_state {
+	SEND_OK = 0,
+	SEND_WAIT_IDR,	/* the decoder lost a reference, deltas are useless until an IDR */
+} send_state_e;
+
+/*
+ * Per connection and layer. Only the layer's sender thread changes it,
+ * except resync, which the SDK thread sets on a bitrate collapse. state and
+ * stats are changed under mtx so agora_get_send_stats can read them.
+ */
+typedef struct send_ctx {
+	std::mutex	mtx;
+	send_state_e	state;
+	int64_t		key_req_ms;
+	std::atomic<bool> resync;
+	agora_send_stats_t stats;
+} send_ctx_t;
 
 typedef struct agora {
 	uint32_t	conn_id[3];
 	agora_connnected_cb_t ccb;
 	agora_msg_cb_t	mcb;
-	bool		user_connected[4];
+	agora_sdk_ops_t	ops;
+	bool		user_connected[4];	/* has viewers */
+	uint32_t	viewer[4][VIEWER_MAX];
+	int		viewers[4];
+	send_ctx_t	send[4][LAYER_NUM];
+	std::atomic<uint32_t> target_bps[4];
+	uint32_t	audio_sent;	/* touched by the audio capture thread only */
+	uint32_t	audio_failed;
+	rdt_state_e	rdt_state[4];	/* tunnel to ARM_UID_BASE, other peers are ignored */
+	uint32_t	rdt_msgs;
+	uint32_t	rtm_msgs;
+	agora_role_e	role;
+	agora_ack_cb_t	acb;
+	std::string	peer_rtm_uid;
+	std::atomic<int> rtm_pending;	/* sent on the publisher thread, acked on the SDK thread */
+	cmd_path_e	tx_path;	/* leader: publisher thread only */
+	std::atomic<int64_t> rdt_retry_ms;
+	uint32_t	fallbacks;
+	std::atomic<int> rx_path;	/* arm: transport of the last command */
 } agora_t;
 
 static agora_t g_agora;
+static agora_role_e g_role = AGORA_ROLE_ARM;
+static int g_conn_num = MAX_CHN_NUM;
+static agora_ack_cb_t g_acb = NULL;
+static agora_key_frame_cb_t g_kcb = NULL;
+static agora_bitrate_cb_t g_bcb = NULL;
+static agora_viewer_cb_t g_vcb = NULL;
+static agora_path_cb_t g_pcb = NULL;
+
+static int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 static size_t write_memory_cb(void *ptr, size_t size, size_t nmemb, void *context)
 {
@@ -32,9 +104,26 @@ static size_t write_memory_cb(void *ptr, size_t size, size_t nmemb, void *contex
 	return nmemb;
 }
 
+static const agora_sdk_ops_t g_sdk_ops = {
+	.send_video_data = agora_rtc_send_video_data,
+	.send_audio_data = agora_rtc_send_audio_data,
+	.send_rdt_msg = agora_rtc_send_rdt_msg,
+	.get_rdt_status_info = agora_rtc_get_rdt_status_info,
+	.send_rtm_data = agora_rtc_send_rtm_data,
+};
+
+/* Both transports are always accepted, the decoders drop what arrives twice. */
+static void agora_rx_path(agora_t *ago, cmd_path_e path)
+{
+	if (ago->rx_path.exchange(path) != path)
+		printf("agora: commands now arrive over %s\n", g_cmd_path_name[path]);
+}
+
 static void __on_rtm_data(const char *user_id, const void *data, size_t data_len)
 {
 	agora_t *ago = &g_agora;
+	ago->rtm_msgs++;
+	agora_rx_path(ago, CMD_PATH_RTM);
 	if (ago->mcb)
 		ago->mcb((const char *)data, data_len);
 }
@@ -46,6 +135,15 @@ static void __on_rtm_event(const char *user_id, rtm_event_type_e event_id, rtm_e
 
 static void __on_rtm_send_data_res(const char *rtm_uid, uint32_t msg_id, rtm_msg_state_e state)
 {
+	agora_t *ago = &g_agora;
+	int pending = ago->rtm_pending;
+	while (pending > 0 && !ago->rtm_pending.compare_exchange_weak(pending, pending - 1))
+		;
+	/* RTM is failing too, probe the tunnel again on the next send */
+	if (state != RTM_MSG_STATE_RECEIVED)
+		ago->rdt_retry_ms = 0;
+	if (ago->acb)
+		ago->acb(msg_id, state == RTM_MSG_STATE_RECEIVED);
 }
 
 static agora_rtm_handler_t rtm_handler = {
@@ -119,18 +217,47 @@ static void __on_rejoin_channel_success(connection_id_t conn_id, uint32_t uid, i
 
 }
 
-static void __on_user_joined(connection_id_t conn_id, uint32_t uid, int elapsed_ms)
+/* Our own camera connections and the leader arm share the channel, they don't watch. */
+static bool agora_is_viewer(uint32_t uid)
+{
+	return (uid < ARM_UID_BASE || uid >= ARM_UID_BASE + MAX_CHN_NUM) && uid != LEADER_UID;
+}
+
+/* A set rather than a counter: joins are repeated after a rejoin. */
+static void agora_update_viewer(connection_id_t conn_id, uint32_t uid, bool joined)
 {
-	printf("func:%s, user joind... conn_id=%d\n", __func__, conn_id);
 	agora_t *ago = &g_agora;
-	ago->user_connected[conn_id] = true;
+	if (conn_id > MAX_CHN_NUM || !agora_is_viewer(uid))
+		return;
+
+	uint32_t *viewer = ago->viewer[conn_id];
+	int n = ago->viewers[conn_id];
+	int i;
+	for (i = 0; i < n && viewer[i] != uid; i++)
+		;
+
+	if (joined && i == n && n < VIEWER_MAX)
+		viewer[ago->viewers[conn_id]++] = uid;
+	else if (!joined && i < n)
+		viewer[i] = viewer[--ago->viewers[conn_id]];
+	else
+		return;
+
+	ago->user_connected[conn_id] = ago->viewers[conn_id] > 0;
+	if (g_vcb)
+		g_vcb((int)conn_id, ago->viewers[conn_id]);
+}
+
+static void __on_user_joined(connection_id_t conn_id, uint32_t uid, int elapsed_ms)
+{
+	printf("func:%s, user joind... conn_id=%d uid=%u\n", __func__, conn_id, uid);
+	agora_update_viewer(conn_id, uid, true);
 }
 
 static void __on_user_offline(connection_id_t conn_id, uint32_t uid, int reason)
 {
-	printf("func:%s, user offline ...\n", __func__);
-	agora_t *ago = &g_agora;
-	ago->user_connected[conn_id] = false;
+	printf("func:%s, user offline ... conn_id=%d uid=%u\n", __func__, conn_id, uid);
+	agora_update_viewer(conn_id, uid, false);
 }
 
 static void __on_user_mute_audio(connection_id_t conn_id, uint32_t uid, bool muted)
@@ -170,41 +297,155 @@ static void __on_video_data(connection_id_t conn_id, const uint32_t uid, uint16_
 static void __on_target_bitrate_changed(connection_id_t conn_id, uint32_t target_bps)
 {
 //	printf("finc:%s, target_bps=%d.\n", __func__, target_bps);
+	agora_t *ago = &g_agora;
+	if (conn_id <= MAX_CHN_NUM) {
+		uint32_t prev = ago->target_bps[conn_id].exchange(target_bps);
+		/* what is queued in the SDK was sized for the old rate, restart on a small IDR */
+		if (target_bps < prev / SEND_COLLAPSE_DIV) {
+			for (int i = 0; i < LAYER_NUM; i++)
+				ago->send[conn_id][i].resync = true;
+		}
+	}
+
+	if (g_bcb)
+		g_bcb((int)conn_id, target_bps);
 }
 
 static void __on_key_frame_gen_req(connection_id_t conn_id, uint32_t uid,
 		video_stream_type_e stream_type)
 {
+	if (g_kcb)
+		g_kcb((int)conn_id, stream_type == VIDEO_STREAM_LOW);
 }
 
-int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
+static void __on_rdt_state(connection_id_t conn_id, uint32_t uid, rdt_state_e state)
 {
-	memset(&g_agora, 0, sizeof(g_agora));
+	printf("func:%s, conn_id=%d uid=%u state=%d\n", __func__, conn_id, uid, state);
 	agora_t *ago = &g_agora;
+	if (conn_id > MAX_CHN_NUM)
+		return;
+
+	/* commands only ever go to the arm, viewers' tunnels don't matter */
+	if (uid != ARM_UID_BASE)
+		return;
+
+	ago->rdt_state[conn_id] = state;
+}
+
+static void __on_rdt_msg(connection_id_t conn_id, uint32_t uid, rdt_stream_type_e type,
+		const void *msg, size_t len)
+{
+	agora_t *ago = &g_agora;
+	ago->rdt_msgs++;
+	agora_rx_path(ago, CMD_PATH_RDT);
+	if (ago->mcb)
+		ago->mcb((const char *)msg, len);
+}
+
+static agora_rtc_event_handler_t event_handler = {
+	.on_join_channel_success = __on_join_channel_success,
+	.on_reconnecting = __on_reconnecting,
+	.on_connection_lost = __on_connection_lost,
+	.on_rejoin_channel_success = __on_rejoin_channel_success,
+	.on_license_validation_failure = __on_license_failed,
+	.on_error = __on_error,
+	.on_user_joined = __on_user_joined,
+	.on_user_offline = __on_user_offline,
+	.on_user_mute_audio = __on_user_mute_audio,
+	.on_user_mute_video = __on_user_mute_video,
+	.on_audio_data = __on_audio_data,
+	.on_mixed_audio_data = __on_mixed_audio_data,
+	.on_video_data = __on_video_data,
+	.on_target_bitrate_changed = __on_target_bitrate_changed,
+	.on_key_frame_gen_req = __on_key_frame_gen_req,
+	.on_rdt_state = __on_rdt_state,
+	.on_rdt_msg = __on_rdt_msg,
+};
+
+void agora_set_role(agora_role_e role, agora_ack_cb_t acb)
+{
+	g_role = role;
+	g_acb = acb;
+}
+
+void agora_set_conn_num(int conn_num)
+{
+	if (conn_num >= 1 && conn_num <= MAX_CHN_NUM)
+		g_conn_num = conn_num;
+}
+
+void agora_set_key_frame_cb(agora_key_frame_cb_t kcb)
+{
+	g_kcb = kcb;
+}
+
+void agora_set_bitrate_cb(agora_bitrate_cb_t bcb)
+{
+	g_bcb = bcb;
+}
+
+void agora_set_viewer_cb(agora_viewer_cb_t vcb)
+{
+	g_vcb = vcb;
+}
+
+void agora_set_path_cb(agora_path_cb_t pcb)
+{
+	g_pcb = pcb;
+}
+
+int agora_shim_init(const agora_sdk_ops_t *ops, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
+{
+	agora_t *ago = &g_agora;
+	ago->peer_rtm_uid.clear();
+	memset(ago->conn_id, 0, sizeof(ago->conn_id));
+	memset(ago->user_connected, 0, sizeof(ago->user_connected));
+	memset(ago->viewers, 0, sizeof(ago->viewers));
+	for (int i = 0; i <= MAX_CHN_NUM; i++) {
+		ago->target_bps[i] = 0;
+		for (int j = 0; j < LAYER_NUM; j++) {
+			send_ctx_t *sc = &ago->send[i][j];
+			sc->state = SEND_OK;
+			sc->key_req_ms = 0;
+			sc->resync = false;
+			memset(&sc->stats, 0, sizeof(sc->stats));
+		}
+	}
+	memset(ago->rdt_state, 0, sizeof(ago->rdt_state));
+	ago->rdt_msgs = 0;
+	ago->rtm_msgs = 0;
+	ago->rtm_pending = 0;
+	ago->tx_path = CMD_PATH_RTM;
+	ago->rdt_retry_ms = 0;
+	ago->fallbacks = 0;
+	ago->rx_path = CMD_PATH_RTM;
+	ago->role = g_role;
+	ago->acb = g_acb;
 	ago->ccb = ccb;
 	ago->mcb = mcb;
+	ago->ops = *ops;
+
+	return 0;
+}
+
+const agora_rtc_event_handler_t *agora_shim_event_handler()
+{
+	return &event_handler;
+}
+
+const agora_rtm_handler_t *agora_shim_rtm_handler()
+{
+	return &rtm_handler;
+}
+
+int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
+{
+	agora_shim_init(&g_sdk_ops, ccb, mcb);
+	agora_t *ago = &g_agora;
 
 	rtc_service_option_t service_opt = { 0 };
 	service_opt.area_code = AREA_CODE_GLOB;
 
-	agora_rtc_event_handler_t event_handler;
-	memset(&event_handler, 0, sizeof(event_handler));
-	event_handler.on_join_channel_success = __on_join_channel_success;
-	event_handler.on_reconnecting = __on_reconnecting,
-	event_handler.on_connection_lost = __on_connection_lost;
-	event_handler.on_rejoin_channel_success = __on_rejoin_channel_success;
-	event_handler.on_user_joined = __on_user_joined;
-	event_handler.on_user_offline = __on_user_offline;
-	event_handler.on_user_mute_audio = __on_user_mute_audio;
-	event_handler.on_user_mute_video = __on_user_mute_video;
-	event_handler.on_target_bitrate_changed = __on_target_bitrate_changed;
-	event_handler.on_key_frame_gen_req = __on_key_frame_gen_req;
-	event_handler.on_video_data = __on_video_data;
-	event_handler.on_error = __on_error;
-	event_handler.on_license_validation_failure = __on_license_failed;
-	event_handler.on_mixed_audio_data = __on_mixed_audio_data;
-	event_handler.on_audio_data = __on_audio_data;
-
 	int rval = agora_rtc_init("3b64a6f5683d4abe9a7f3f72b7e7e9c8", &event_handler, &service_opt);
 	if (rval < 0) {
 		printf("agora sdk init failed, rval=%d error=%s\n", rval, agora_rtc_err_2_str(rval));
@@ -215,6 +456,10 @@ int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
 	std::string rtm_uid = room;
 	if  (rtm_uid != "gello") 
 		rtm_uid += "-arm";
+	if (ago->role == AGORA_ROLE_LEADER) {
+		ago->peer_rtm_uid = rtm_uid;
+		rtm_uid = room + "-leader";
+	}
 	std::string url = "https://is2ef74oirsuxgzg6e4b6w64xy0zykul.lambda-url.ap-southeast-1.on.aws/api/agora/token";
 	//std::string body = "{\"rtc_uid\": 0,\"rtm_uid\": \"mycobot\", \"channel\": \""; //gello\"}";
 	std::string body = "{\"rtc_uid\": 0,\"rtm_uid\": \"";
@@ -259,7 +504,8 @@ int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
 		break;
 	}
 
-	for (int i = 0; i < MAX_CHN_NUM; i++) {
+	int conn_num = (ago->role == AGORA_ROLE_LEADER) ? 1 : g_conn_num;
+	for (int i = 0; i < conn_num; i++) {
 		rval = agora_rtc_create_connection(&ago->conn_id[i]);
 		if (rval < 0) {
 			printf("Failed to create connection, reason: %s\b", agora_rtc_err_2_str(rval));
@@ -268,9 +514,11 @@ int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
 
 		rtc_channel_options_t channel_options = { 0 };
 		memset(&channel_options, 0, sizeof(channel_options));
+		channel_options.auto_connect_rdt = true;
 
 		//rval = agora_rtc_join_channel(g_camera_services[i].conn_id, "gello", 1000 + i, rtc_token.c_str(), &channel_options);
-		rval = agora_rtc_join_channel(ago->conn_id[i], channel_name.c_str(), 1000 + i, rtc_token.c_str(), &channel_options);
+		uint32_t uid = (ago->role == AGORA_ROLE_LEADER) ? LEADER_UID : ARM_UID_BASE + i;
+		rval = agora_rtc_join_channel(ago->conn_id[i], channel_name.c_str(), uid, rtc_token.c_str(), &channel_options);
 		if (rval < 0) {
 			printf("Failed to join channel, reason: %s\n", agora_rtc_err_2_str(rval));
 			return -1;
@@ -290,29 +538,224 @@ int agora_init(std::string room, agora_connnected_cb_t ccb, agora_msg_cb_t mcb)
 
 void agora_final()
 {
+	agora_t *ago = &g_agora;
+	printf("agora commands: rdt[%u] rtm[%u] fallbacks[%u]\n", ago->rdt_msgs, ago->rtm_msgs, ago->fallbacks);
+	for (int i = 0; i <= MAX_CHN_NUM; i++) {
+		for (int j = 0; j < LAYER_NUM; j++) {
+			agora_send_stats_t st;
+			agora_get_send_stats(i, j != 0, &st);
+			if (!st.sent && !st.failed && !st.dropped)
+				continue;
+			printf("agora conn[%d]%s: sent[%u] failed[%u] dropped[%u] collapses[%u] key_req[%u]\n",
+					i, j ? " low" : "", st.sent, st.failed, st.dropped, st.collapses, st.key_req);
+		}
+	}
+	if (ago->audio_sent || ago->audio_failed)
+		printf("agora audio: sent[%u] failed[%u]\n", ago->audio_sent, ago->audio_failed);
+
 	agora_rtc_logout_rtm();
 	agora_rtc_fini();
 }
 
+static void agora_send_key_req(send_ctx_t *sc, int conn_id, bool low, int64_t now)
+{
+	{
+		std::lock_guard<std::mutex> lg(sc->mtx);
+		sc->key_req_ms = now;
+		sc->stats.key_req++;
+	}
+	if (g_kcb)
+		g_kcb(conn_id, low);
+}
+
+/*
+ * Decides whether a frame is worth sending. Once the receiver is missing a
+ * reference, every delta until the next IDR is dropped here and the IDR is
+ * asked for, so viewers see a short freeze instead of smeared frames.
+ */
+static bool agora_send_admit(send_ctx_t *sc, int conn_id, bool low, bool key)
+{
+	if (sc->resync.exchange(false) && sc->state == SEND_OK) {
+		std::lock_guard<std::mutex> lg(sc->mtx);
+		sc->state = SEND_WAIT_IDR;
+		sc->stats.collapses++;
+		sc->key_req_ms = 0;
+	}
+
+	if (key) {
+		std::lock_guard<std::mutex> lg(sc->mtx);
+		sc->state = SEND_OK;
+		return true;
+	}
+
+	if (sc->state == SEND_OK)
+		return true;
+
+	int64_t now = now_ms();
+	if (now - sc->key_req_ms >= SEND_KEY_RETRY_MS)
+		agora_send_key_req(sc, conn_id, low, now);
+	std::lock_guard<std::mutex> lg(sc->mtx);
+	sc->stats.dropped++;
+	return false;
+}
+
 int agora_frame_send(int conn_id, const hal_frame_t *frame)
 {
 	agora_t *ago = &g_agora;
-
-	if (false == ago->user_connected[conn_id])
+	bool low = frame->m_stream_type == HST_SUB;
+	bool key = frame->m_frame_type == HFT_I;
+	send_ctx_t *sc = &ago->send[conn_id][low ? 1 : 0];
+
+	if (false == ago->user_connected[conn_id]) {
+		/* a viewer joining later can't use our deltas either, no request until then */
+		if (!key && sc->state == SEND_OK) {
+			std::lock_guard<std::mutex> lg(sc->mtx);
+			sc->state = SEND_WAIT_IDR;
+			sc->key_req_ms = 0;
+		}
 		return -1;
+	}
+
+	if (!agora_send_admit(sc, conn_id, low, key))
+		return 1;
 
 	video_frame_info_t video_frame_info;
 	memset(&video_frame_info, 0, sizeof(video_frame_info));
 	video_frame_info.frame_rate = (video_frame_rate_e)30;
-	video_frame_info.data_type = VIDEO_DATA_TYPE_H264;
-	video_frame_info.stream_type = VIDEO_STREAM_HIGH;
-	video_frame_info.frame_type = (frame->m_frame_type == HFT_I)? VIDEO_FRAME_KEY : VIDEO_FRAME_DELTA;
+	video_frame_info.data_type = (frame->m_enc_type == HET_H265) ? VIDEO_DATA_TYPE_H265 : VIDEO_DATA_TYPE_H264;
+	video_frame_info.stream_type = low ? VIDEO_STREAM_LOW : VIDEO_STREAM_HIGH;
+	video_frame_info.frame_type = key ? VIDEO_FRAME_KEY : VIDEO_FRAME_DELTA;
 
-	int rval = agora_rtc_send_video_data(conn_id, frame->m_data, frame->m_len, &video_frame_info);
+	int rval = ago->ops.send_video_data(conn_id, frame->m_data, frame->m_len, &video_frame_info);
 	if(rval < 0) {
-		printf("send failed: %s", agora_rtc_err_2_str(rval));
+		printf("send failed: %s\n", agora_rtc_err_2_str(rval));
+		bool req;
+		{
+			std::lock_guard<std::mutex> lg(sc->mtx);
+			sc->stats.failed++;
+			req = sc->state == SEND_OK;
+			if (req)
+				sc->state = SEND_WAIT_IDR;
+		}
+		if (req)
+			agora_send_key_req(sc, conn_id, low, now_ms());
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lg(sc->mtx);
+	sc->stats.sent++;
+	return 0;
+}
+
+int agora_audio_send(int conn_id, const hal_frame_t *frame)
+{
+	agora_t *ago = &g_agora;
+
+	/* every Opus frame decodes on its own, nothing to resync */
+	if (false == ago->user_connected[conn_id])
+		return -1;
+
+	audio_frame_info_t audio_frame_info;
+	memset(&audio_frame_info, 0, sizeof(audio_frame_info));
+	audio_frame_info.data_type = AUDIO_DATA_TYPE_OPUSFB;
+
+	int rval = ago->ops.send_audio_data(conn_id, frame->m_data, frame->m_len, &audio_frame_info);
+	if (rval < 0) {
+		/* a hundred frames a second, only the first failure is logged */
+		if (ago->audio_failed++ == 0)
+			printf("send audio failed: %s\n", agora_rtc_err_2_str(rval));
+		return -1;
+	}
+
+	ago->audio_sent++;
+	return 0;
+}
+
+int agora_get_send_stats(int conn_id, bool low, agora_send_stats_t *stats)
+{
+	agora_t *ago = &g_agora;
+	if (conn_id < 0 || conn_id > MAX_CHN_NUM)
+		return -1;
+
+	send_ctx_t *sc = &ago->send[conn_id][low ? 1 : 0];
+	std::lock_guard<std::mutex> lg(sc->mtx);
+	*stats = sc->stats;
+	stats->waiting = sc->state == SEND_WAIT_IDR;
+	return 0;
+}
+
+static bool agora_rdt_ready(agora_t *ago)
+{
+	uint32_t conn_id = ago->conn_id[0];
+	return conn_id <= MAX_CHN_NUM && ago->rdt_state[conn_id] == RDT_STATE_OPENED;
+}
+
+static void agora_set_tx_path(agora_t *ago, cmd_path_e path, const char *why)
+{
+	if (ago->tx_path == path)
+		return;
+
+	printf("agora: commands now sent over %s, %s\n", g_cmd_path_name[path], why);
+	if (path == CMD_PATH_RTM)
+		ago->fallbacks++;
+	ago->tx_path = path;
+	if (g_pcb)
+		g_pcb(path == CMD_PATH_RDT);
+}
+
+int agora_msg_send(const void *msg, int msg_len, uint32_t msg_id)
+{
+	agora_t *ago = &g_agora;
+	int64_t now = now_ms();
+
+	if (ago->tx_path == CMD_PATH_RTM && agora_rdt_ready(ago) && now >= ago->rdt_retry_ms)
+		agora_set_tx_path(ago, CMD_PATH_RDT, "tunnel open");
+	if (ago->tx_path == CMD_PATH_RDT && !agora_rdt_ready(ago))
+		agora_set_tx_path(ago, CMD_PATH_RTM, "tunnel closed");
+
+	if (ago->tx_path == CMD_PATH_RDT) {
+		int rval = ago->ops.send_rdt_msg(ago->conn_id[0], ARM_UID_BASE, RDT_STREAM_CMD, msg, msg_len);
+		if (rval == 0) {
+			/* RDT is reliable and ordered, accepted means delivered unless the tunnel closes, see g_pcb. */
+			if (ago->acb)
+				ago->acb(msg_id, true);
+			return 0;
+		}
+
+		ago->rdt_retry_ms = now + RDT_RETRY_MS;
+		agora_set_tx_path(ago, CMD_PATH_RTM, "send failed");
+	}
+
+	if (ago->peer_rtm_uid.empty())
+		return -1;
+
+	/* counted before the send, the ack may arrive before send_rtm_data returns */
+	ago->rtm_pending++;
+	int rval = ago->ops.send_rtm_data(ago->peer_rtm_uid.c_str(), msg, msg_len, msg_id);
+	if (rval < 0) {
+		ago->rtm_pending--;
+		printf("send rtm failed: %s\n", agora_rtc_err_2_str(rval));
 		return -1;
 	}
 
 	return 0;
 }
+
+int agora_msg_backlog()
+{
+	agora_t *ago = &g_agora;
+
+	if (ago->tx_path == CMD_PATH_RDT) {
+		rdt_status_info_t info;
+		memset(&info, 0, sizeof(info));
+		if (ago->ops.get_rdt_status_info(ago->conn_id[0], ARM_UID_BASE, &info) == 0)
+			return info.send_queue_size[RDT_STREAM_CMD];
+	}
+
+	return ago->rtm_pending;
+}
+
+bool agora_msg_on_rdt()
+{
+	return g_agora.tx_path == CMD_PATH_RDT;
+}
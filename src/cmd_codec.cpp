@@ -0,0 +1,413 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "cmd_codec.h"
+#include <string.h>
+
+#define JSMN_STATIC
+#include "jsmn.h"
+
+#define CMD_MAX_TOKENS 48
+/* Longer numbers are no valid seq, ts or position and could overflow int64_t. */
+#define CMD_MAX_DIGITS 10
+
+static bool tok_eq(const char *js, const jsmntok_t *tok, const char *key)
+{
+	int len = tok->end - tok->start;
+	return tok->type == JSMN_STRING && (int)strlen(key) == len &&
+		memcmp(js + tok->start, key, len) == 0;
+}
+
+/* Integer part of a JSON number token, fractions and exponents are ignored. */
+static bool tok_int(const char *js, const jsmntok_t *tok, int64_t *val)
+{
+	if (tok->type != JSMN_PRIMITIVE)
+		return false;
+
+	const char *p = js + tok->start;
+	const char *end = js + tok->end;
+	bool neg = false;
+	if (p < end && *p == '-') {
+		neg = true;
+		p++;
+	}
+
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+
+	int64_t v = 0;
+	int digits = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (++digits > CMD_MAX_DIGITS)
+			return false;
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+
+	*val = neg ? -v : v;
+	return true;
+}
+
+/* Index of the token following the subtree rooted at i. */
+static int tok_skip(const jsmntok_t *toks, int ntok, int i)
+{
+	int pending = 1;
+	while (pending > 0 && i < ntok) {
+		pending += toks[i].size - 1;
+		i++;
+	}
+	return i;
+}
+
+/* Tokens of a JSON object, returns their count or -1. */
+static int json_tokenize(const char *msg, int msg_len, jsmntok_t *toks)
+{
+	jsmn_parser parser;
+
+	if (msg_len <= 0)
+		return -1;
+
+	jsmn_init(&parser);
+	int ntok = jsmn_parse(&parser, msg, msg_len, toks, CMD_MAX_TOKENS);
+	if (ntok < 1 || toks[0].type != JSMN_OBJECT)
+		return -1;
+	return ntok;
+}
+
+static int json_arm(const char *msg, const jsmntok_t *toks, int ntok, st_cmd_t *cmd)
+{
+	memset(cmd, 0, sizeof(*cmd));
+
+	int n = -1;
+	int i = 1;
+	while (i < ntok) {
+		const jsmntok_t *key = &toks[i];
+		const jsmntok_t *val = &toks[i + 1];
+		int64_t v;
+
+		if (i + 1 >= ntok)
+			return -1;
+
+		if (tok_eq(msg, key, "seq") && tok_int(msg, val, &v)) {
+			if (v < 0 || v > UINT32_MAX)
+				return -1;
+			cmd->seq = (uint32_t)v;
+		} else if (tok_eq(msg, key, "ts") && tok_int(msg, val, &v)) {
+			if (v < 0 || v > UINT32_MAX)
+				return -1;
+			cmd->ts = (uint32_t)v;
+		} else if (tok_eq(msg, key, "angles") && val->type == JSMN_ARRAY) {
+			n = val->size;
+			for (int j = 0; j < n && j < ST_JOINT_NUMBER; j++) {
+				if (tok_int(msg, &toks[i + 2 + j], &v)) {
+					/* a wrapped angle would be a valid looking, wrong position */
+					if (v < INT16_MIN || v > INT16_MAX)
+						return -1;
+					cmd->pos[j] = (int16_t)v;
+					cmd->mask |= 1u << j;
+				}
+			}
+		}
+
+		i = tok_skip(toks, ntok, i + 1);
+	}
+
+	if (n != ST_JOINT_NUMBER)
+		return -1;
+
+	return 0;
+}
+
+int cmd_decode_json(const char *msg, int msg_len, st_cmd_t *cmd)
+{
+	jsmntok_t toks[CMD_MAX_TOKENS];
+
+	int ntok = json_tokenize(msg, msg_len, toks);
+	if (ntok < 0)
+		return -1;
+
+	return json_arm(msg, toks, ntok, cmd);
+}
+
+int cmd_parse_json(const char *msg, int msg_len, cmd_json_t *out)
+{
+	jsmntok_t toks[CMD_MAX_TOKENS];
+
+	int ntok = json_tokenize(msg, msg_len, toks);
+	if (ntok < 0)
+		return -1;
+
+	/* value token of the first "layers" and "dump" keys */
+	int layers = -1;
+	int dump = -1;
+	int i = 1;
+	while (i + 1 < ntok) {
+		if (layers < 0 && tok_eq(msg, &toks[i], "layers") && toks[i + 1].type == JSMN_ARRAY)
+			layers = i + 1;
+		else if (dump < 0 && tok_eq(msg, &toks[i], "dump"))
+			dump = i + 1;
+
+		i = tok_skip(toks, ntok, i + 1);
+	}
+
+	if (layers > 0) {
+		const jsmntok_t *val = &toks[layers];
+		out->layer_num = 0;
+		for (int j = 0; j < val->size && j < CMD_LAYERS_MAX && layers + 1 + j < ntok; j++) {
+			int64_t v;
+			if (!tok_int(msg, &toks[layers + 1 + j], &v))
+				return -1;
+			out->layers[out->layer_num++] = (uint32_t)v;
+		}
+		return CMD_JSON_LAYERS;
+	}
+
+	if (dump > 0) {
+		const jsmntok_t *val = &toks[dump];
+		int len = (val->type == JSMN_STRING) ? val->end - val->start : 0;
+		if (len >= CMD_REASON_MAX)
+			len = CMD_REASON_MAX - 1;
+		memcpy(out->reason, msg + val->start, len);
+		out->reason[len] = '\0';
+		return CMD_JSON_DUMP;
+	}
+
+	if (json_arm(msg, toks, ntok, &out->cmd) < 0)
+		return -1;
+	return CMD_JSON_ARM;
+}
+
+static int get_varint(const uint8_t *p, const uint8_t *end, int32_t *val)
+{
+	uint32_t v = 0;
+	int shift = 0;
+	const uint8_t *s = p;
+
+	while (p < end && shift < 35) {
+		uint8_t b = *p++;
+		v |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*val = (int32_t)((v >> 1) ^ -(v & 1));
+			return p - s;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+static int put_varint(uint8_t *p, int32_t val)
+{
+	uint32_t v = ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static cmd_ref_t *cmd_find_ref(cmd_decoder_t *dec, uint32_t seq)
+{
+	cmd_ref_t *ref = &dec->hist[seq % CMD_HIST_SIZE];
+	return (ref->seq == seq && ref->mask) ? ref : NULL;
+}
+
+void cmd_decoder_init(cmd_decoder_t *dec)
+{
+	memset(dec, 0, sizeof(*dec));
+}
+
+int cmd_decode_bin(cmd_decoder_t *dec, const uint8_t *buf, int len, st_cmd_t *cmd)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+
+	if (len < 12 || p[0] != CMD_BIN_MAGIC || p[1] != CMD_BIN_VERSION)
+		return -1;
+
+	uint8_t flags = p[2];
+	uint32_t mask = p[3] & ((1u << ST_JOINT_NUMBER) - 1);
+	if (mask != p[3])
+		return -1;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->seq = get_u32(p + 4);
+	cmd->ts = get_u32(p + 8);
+	p += 12;
+
+	if (flags & CMD_BIN_F_DELTA) {
+		if (end - p < 4)
+			return -1;
+		cmd_ref_t *ref = cmd_find_ref(dec, get_u32(p));
+		p += 4;
+		if (!ref || ref->flags != (flags & ~CMD_BIN_F_DELTA))
+			return -1;
+
+		memcpy(cmd->speed, ref->speed, sizeof(cmd->speed));
+		memcpy(cmd->acc, ref->acc, sizeof(cmd->acc));
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			cmd->pos[i] = ref->pos[i];
+			if (!(mask & (1u << i)))
+				continue;
+			int32_t d;
+			int n = get_varint(p, end, &d);
+			if (n < 0)
+				return -1;
+			int64_t pos = (int64_t)cmd->pos[i] + d;
+			if (pos < INT16_MIN || pos > INT16_MAX)
+				return -1;
+			cmd->pos[i] = (int16_t)pos;
+			p += n;
+		}
+		cmd->mask = mask | ref->mask;
+	} else {
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (!(mask & (1u << i)))
+				continue;
+			if (end - p < 2)
+				return -1;
+			cmd->pos[i] = (int16_t)(p[0] | (p[1] << 8));
+			p += 2;
+		}
+		cmd->mask = mask;
+	}
+
+	if (flags & CMD_BIN_F_SPEED) {
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (!(mask & (1u << i)))
+				continue;
+			if (end - p < 2)
+				return -1;
+			cmd->speed[i] = p[0] | (p[1] << 8);
+			p += 2;
+		}
+		cmd->flags |= ST_CMD_F_SPEED;
+	}
+
+	if (flags & CMD_BIN_F_ACC) {
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (!(mask & (1u << i)))
+				continue;
+			if (end - p < 1)
+				return -1;
+			cmd->acc[i] = *p++;
+		}
+		cmd->flags |= ST_CMD_F_ACC;
+	}
+
+	cmd_ref_t *slot = &dec->hist[cmd->seq % CMD_HIST_SIZE];
+	slot->seq = cmd->seq;
+	slot->mask = cmd->mask;
+	slot->flags = flags & ~CMD_BIN_F_DELTA;
+	memcpy(slot->pos, cmd->pos, sizeof(slot->pos));
+	memcpy(slot->speed, cmd->speed, sizeof(slot->speed));
+	memcpy(slot->acc, cmd->acc, sizeof(slot->acc));
+
+	return p - buf;
+}
+
+int cmd_encode_bin(const st_cmd_t *cmd, const st_cmd_t *ref, uint8_t *buf, int buf_len)
+{
+	uint32_t mask = cmd->mask & ((1u << ST_JOINT_NUMBER) - 1);
+	uint8_t flags = 0;
+
+	if (buf_len < CMD_BIN_MAX_LEN)
+		return -1;
+
+	if (ref)
+		flags |= CMD_BIN_F_DELTA;
+	if (cmd->flags & ST_CMD_F_SPEED)
+		flags |= CMD_BIN_F_SPEED;
+	if (cmd->flags & ST_CMD_F_ACC)
+		flags |= CMD_BIN_F_ACC;
+
+	uint8_t *p = buf;
+	p[0] = CMD_BIN_MAGIC;
+	p[1] = CMD_BIN_VERSION;
+	p[2] = flags;
+	p[3] = mask;
+	put_u32(p + 4, cmd->seq);
+	put_u32(p + 8, cmd->ts);
+	p += 12;
+
+	if (ref) {
+		put_u32(p, ref->seq);
+		p += 4;
+	}
+
+	for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+		if (ref) {
+			p += put_varint(p, (int32_t)cmd->pos[i] - ref->pos[i]);
+		} else {
+			p[0] = cmd->pos[i];
+			p[1] = (uint16_t)cmd->pos[i] >> 8;
+			p += 2;
+		}
+	}
+
+	if (flags & CMD_BIN_F_SPEED) {
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (!(mask & (1u << i)))
+				continue;
+			p[0] = cmd->speed[i];
+			p[1] = cmd->speed[i] >> 8;
+			p += 2;
+		}
+	}
+
+	if (flags & CMD_BIN_F_ACC) {
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (mask & (1u << i))
+				*p++ = cmd->acc[i];
+		}
+	}
+
+	return p - buf;
+}
+
+int cmd_decode(cmd_decoder_t *dec, const void *msg, int msg_len, cmd_handler_t cb)
+{
+	const uint8_t *p = (const uint8_t *)msg;
+	st_cmd_t cmd;
+
+	if (msg_len <= 0)
+		return -1;
+
+	if (p[0] != CMD_BIN_MAGIC) {
+		if (cmd_decode_json((const char *)msg, msg_len, &cmd) < 0)
+			return -1;
+		cb(&cmd);
+		return 1;
+	}
+
+	int count = 0;
+	while (msg_len > 0) {
+		int n = cmd_decode_bin(dec, p, msg_len, &cmd);
+		if (n < 0)
+			return count ? count : -1;
+		cb(&cmd);
+		p += n;
+		msg_len -= n;
+		count++;
+	}
+
+	return count;
+}
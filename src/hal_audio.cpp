@@ -0,0 +1,205 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_audio.h"
+#include "hal_stat.h"
+#include "gst/gst.h"
+#include "gst/app/gstappsink.h"
+#include <thread>
+#include <atomic>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define AUDIO_RATE		48000
+#define AUDIO_BITRATE		32000
+#define AUDIO_DESC_MAX		512
+#define AUDIO_PULL_TIMEOUT	(100 * GST_MSECOND)
+#define AUDIO_RESTART_US	1000000
+
+typedef struct hal_audio {
+	hal_audio_cfg_t	cfg;
+	hal_frame_cb_t	cb;
+	GstElement	*pipeline;
+	GstElement	*app_sink;
+	std::thread	tid;
+	std::atomic<bool> b_exit;
+	uint32_t	frames;
+	uint32_t	restarts;
+} hal_audio_t;
+
+static hal_audio_t g_audio;
+
+static void audio_build_pipeline(const hal_audio_cfg_t *cfg, char *desc, size_t size)
+{
+	char src[160];
+	int max_buffers = cfg->buffer_ms / cfg->frame_ms;
+	if (max_buffers < 1)
+		max_buffers = 1;
+
+	/* the source delivers one frame's worth of samples at a time */
+	if (strcmp(cfg->device, "test") == 0)
+		snprintf(src, sizeof(src), "audiotestsrc is-live=true wave=ticks samplesperbuffer=%d",
+				AUDIO_RATE * cfg->frame_ms / 1000);
+	else if (strcmp(cfg->device, "pulse") == 0)
+		snprintf(src, sizeof(src), "pulsesrc buffer-time=%d latency-time=%d",
+				cfg->buffer_ms * 1000, cfg->frame_ms * 1000);
+	else
+		snprintf(src, sizeof(src), "alsasrc device=%s buffer-time=%d latency-time=%d",
+				cfg->device, cfg->buffer_ms * 1000, cfg->frame_ms * 1000);
+
+	/* a late sender drops the oldest frames instead of adding delay */
+	snprintf(desc, size, "%s ! audioconvert ! audioresample ! "
+			"audio/x-raw,rate=%d,channels=1 ! "
+			"opusenc bitrate=%d frame-size=%d audio-type=restricted-lowdelay ! "
+			"appsink name=audio-sink max-buffers=%d drop=true sync=false",
+			src, AUDIO_RATE, AUDIO_BITRATE, cfg->frame_ms, max_buffers);
+}
+
+static uint64_t audio_stamp(hal_audio_t *au, GstBuffer *buffer)
+{
+	GstClock *clock = gst_element_get_clock(au->pipeline);
+	if (!clock || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))) {
+		if (clock)
+			gst_object_unref(clock);
+		return hal_now_us();
+	}
+
+	GstClockTime base = gst_element_get_base_time(au->pipeline);
+	GstClockTimeDiff age = (GstClockTimeDiff)(gst_clock_get_time(clock) - (base + GST_BUFFER_PTS(buffer)));
+	gst_object_unref(clock);
+	return (uint64_t)((int64_t)hal_now_us() - age / 1000);
+}
+
+static void audio_send_sample(hal_audio_t *au, GstSample *sample)
+{
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+	GstMapInfo map;
+	if (!buffer || !gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return;
+
+	hal_frame_t frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.m_enc_type = HET_OPUS;
+	frame.m_frame_type = HFT_I;
+	frame.m_stream_type = HST_MAIN;
+	frame.m_data = map.data;
+	frame.m_len = map.size;
+	frame.pts = audio_stamp(au, buffer);
+	frame.dts = frame.pts;
+
+	au->cb(au->cfg.ch, &frame, NULL);
+	au->frames++;
+	gst_buffer_unmap(buffer, &map);
+}
+
+/* Returns true when the pipeline stopped on an error or EOS. */
+static bool audio_check_bus(hal_audio_t *au, GstBus *bus)
+{
+	GstMessage *msg = gst_bus_pop_filtered(bus, (GstMessageType)(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+	if (!msg)
+		return false;
+
+	if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+		GError *err = NULL;
+		gchar *debug = NULL;
+		gst_message_parse_error(msg, &err, &debug);
+		printf("audio: %s\n", err ? err->message : "unknown error");
+		g_clear_error(&err);
+		g_free(debug);
+	} else {
+		printf("audio: end of stream\n");
+	}
+	gst_message_unref(msg);
+	return true;
+}
+
+static void audio_capture_proc()
+{
+	hal_audio_t *au = &g_audio;
+	GstBus *bus = gst_element_get_bus(au->pipeline);
+
+	while (!au->b_exit) {
+		GstSample *sample = gst_app_sink_try_pull_sample(GST_APP_SINK(au->app_sink), AUDIO_PULL_TIMEOUT);
+		if (sample) {
+			audio_send_sample(au, sample);
+			gst_sample_unref(sample);
+			continue;
+		}
+
+		if (!audio_check_bus(au, bus))
+			continue;
+
+		/* unplugged or busy device: keep trying, the connection stays up meanwhile */
+		gst_element_set_state(au->pipeline, GST_STATE_NULL);
+		for (uint64_t t = 0; t < AUDIO_RESTART_US && !au->b_exit; t += 100000)
+			usleep(100000);
+		if (!au->b_exit) {
+			au->restarts++;
+			gst_element_set_state(au->pipeline, GST_STATE_PLAYING);
+		}
+	}
+
+	gst_object_unref(bus);
+}
+
+int hal_audio_init(const hal_audio_cfg_t *cfg, hal_frame_cb_t cb)
+{
+	hal_audio_t *au = &g_audio;
+
+	if (cfg->frame_ms != 10 && cfg->frame_ms != 20) {
+		printf("audio: frame of %d ms not supported, use 10 or 20.\n", cfg->frame_ms);
+		return -1;
+	}
+
+	gst_init(NULL, NULL);
+
+	char desc[AUDIO_DESC_MAX];
+	GError *err = NULL;
+	audio_build_pipeline(cfg, desc, sizeof(desc));
+	au->pipeline = gst_parse_launch(desc, &err);
+	if (err) {
+		printf("audio: %s\n", err->message);
+		g_error_free(err);
+	}
+	if (!au->pipeline)
+		return -1;
+
+	au->app_sink = gst_bin_get_by_name(GST_BIN(au->pipeline), "audio-sink");
+	if (!au->app_sink) {
+		gst_object_unref(au->pipeline);
+		au->pipeline = NULL;
+		return -1;
+	}
+
+	au->cfg = *cfg;
+	au->cb = cb;
+	au->frames = 0;
+	au->restarts = 0;
+	au->b_exit = false;
+	if (gst_element_set_state(au->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+		printf("audio: %s failed to start, retrying\n", cfg->device);
+
+	au->tid = std::thread(audio_capture_proc);
+	printf("audio: %s opus %d ms frames, %d ms buffer, on camera%d\n", cfg->device,
+			cfg->frame_ms, cfg->buffer_ms, cfg->ch);
+	return 0;
+}
+
+void hal_audio_final()
+{
+	hal_audio_t *au = &g_audio;
+	if (!au->pipeline)
+		return;
+
+	au->b_exit = true;
+	if (au->tid.joinable())
+		au->tid.join();
+
+	gst_element_set_state(au->pipeline, GST_STATE_NULL);
+	gst_object_unref(au->app_sink);
+	gst_object_unref(au->pipeline);
+	au->app_sink = NULL;
+	au->pipeline = NULL;
+	printf("audio: frames[%u] restarts[%u]\n", au->frames, au->restarts);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_nal.h"
+#include <string.h>
+
+#define HAS_ZERO_BYTE(v) (((v) - 0x0101010101010101ULL) & ~(v) & 0x8080808080808080ULL)
+
+const uint8_t *hal_nal_find_start(const uint8_t *p, const uint8_t *end, int *sc_len)
+{
+	while (p + 3 <= end) {
+		/* Skip words without any zero byte, a start code can't begin inside them. */
+		while (p + 8 <= end) {
+			uint64_t v;
+			memcpy(&v, p, sizeof(v));
+			if (HAS_ZERO_BYTE(v))
+				break;
+			p += 8;
+		}
+
+		const uint8_t *limit = (p + 8 <= end) ? p + 8 : end - 2;
+		for (; p < limit && p + 3 <= end; p++) {
+			if (p[0] != 0 || p[1] != 0)
+				continue;
+			if (p[2] == 1) {
+				*sc_len = 3;
+				return p;
+			}
+			if (p[2] == 0 && p + 4 <= end && p[3] == 1) {
+				*sc_len = 4;
+				return p;
+			}
+		}
+	}
+
+	*sc_len = 0;
+	return end;
+}
+
+int hal_nal_parse_au(const uint8_t *buf, uint32_t len, hal_enc_type_e enc, hal_au_info_t *info)
+{
+	const uint8_t *end = buf + len;
+	bool h265 = enc == HET_H265;
+	uint8_t aud = h265 ? H265_NAL_AUD : H264_NAL_AUD;
+	int sc_len;
+
+	memset(info, 0, sizeof(*info));
+	info->payload = buf;
+	info->payload_len = len;
+
+	const uint8_t *p = hal_nal_find_start(buf, end, &sc_len);
+	bool leading = true;
+
+	while (p < end) {
+		int next_sc;
+		const uint8_t *next = hal_nal_find_start(p + sc_len, end, &next_sc);
+
+		hal_nal_t nal;
+		nal.data = p;
+		nal.len = next - p;
+		nal.type = 0;
+		if (p + sc_len < end)
+			nal.type = h265 ? (p[sc_len] >> 1) & 0x3f : p[sc_len] & 0x1f;
+		info->nal_count++;
+
+		if (h265) {
+			if (nal.type >= H265_NAL_BLA_W_LP && nal.type <= H265_NAL_CRA)
+				info->key = true;
+			else if (nal.type == H265_NAL_VPS)
+				info->vps = nal;
+			else if (nal.type == H265_NAL_SPS)
+				info->sps = nal;
+			else if (nal.type == H265_NAL_PPS)
+				info->pps = nal;
+		} else {
+			switch (nal.type) {
+			case H264_NAL_IDR:
+				info->key = true;
+				break;
+			case H264_NAL_SPS:
+				info->sps = nal;
+				break;
+			case H264_NAL_PPS:
+				info->pps = nal;
+				break;
+			}
+		}
+
+		if (leading && nal.type == aud) {
+			info->payload = next;
+			info->payload_len = end - next;
+		} else {
+			leading = false;
+		}
+
+		p = next;
+		sc_len = next_sc;
+	}
+
+	return info->nal_count > 0 ? 0 : -1;
+}
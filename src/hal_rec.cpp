@@ -0,0 +1,471 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_rec.h"
+#include "hal_stream.h"
+#include "hal_stat.h"
+#include "gst/gst.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define REC_CAMERA_MAX	HAL_CAMERA_MAX
+/* Per camera, older GOPs are dropped early beyond this. */
+#define REC_BYTES_MAX	(8 * 1024 * 1024)
+#define REC_CMD_MAX	4096
+/*
+ * Encoder pool buffers a camera may hold until the writer thread has swapped
+ * them for copies, beyond that its frames are skipped up to the next IDR.
+ */
+#define REC_POOL_MAX	2
+
+typedef struct rec_frame {
+	GstBuffer	*buffer;
+	uint64_t	pts_us;
+	bool		key;
+	bool		pooled;		/* buffer still belongs to the encoder's pool */
+} rec_frame_t;
+
+/* A GOP starts on an IDR, the ring only ever drops whole GOPs. */
+typedef struct rec_gop {
+	std::vector<rec_frame_t> frames;
+	uint64_t	start_us;
+	uint32_t	bytes;
+} rec_gop_t;
+
+typedef struct rec_ring {
+	std::deque<rec_gop_t> gops;
+	hal_enc_type_e	enc;
+	uint32_t	bytes;
+	int		pooled;
+	bool		wait_key;
+	uint32_t	skipped;
+} rec_ring_t;
+
+typedef struct rec_cmd {
+	uint64_t	t_us;
+	st_cmd_t	cmd;
+} rec_cmd_t;
+
+/* A snapshot handed to the writer, it owns one reference per frame. */
+typedef struct rec_job {
+	std::string	reason;
+	uint64_t	t_us;
+	hal_enc_type_e	enc[REC_CAMERA_MAX];
+	std::vector<rec_frame_t> frames[REC_CAMERA_MAX];
+	std::vector<rec_cmd_t> cmds;
+} rec_job_t;
+
+typedef struct hal_rec {
+	bool		enabled;
+	uint64_t	window_us;
+	std::string	dir;
+	std::mutex	mtx;
+	rec_ring_t	ring[REC_CAMERA_MAX];
+	rec_cmd_t	cmd[REC_CMD_MAX];
+	int		cmd_head;
+	int		cmd_cnt;
+	std::thread	tid;
+	std::condition_variable cond;
+	rec_job_t	*job;		/* pending or being written */
+	bool		detach;		/* pool buffers wait for their copy */
+	bool		b_exit;
+} hal_rec_t;
+
+static hal_rec_t g_rec;
+
+static void rec_gop_release(rec_ring_t *ring, rec_gop_t *gop)
+{
+	for (size_t i = 0; i < gop->frames.size(); i++) {
+		if (gop->frames[i].pooled)
+			ring->pooled--;
+		gst_buffer_unref(gop->frames[i].buffer);
+	}
+	gop->frames.clear();
+}
+
+/* Put copy in place of the ring's reference to orig, false once orig left the ring. */
+static bool rec_replace(rec_ring_t *ring, GstBuffer *orig, GstBuffer *copy)
+{
+	for (size_t g = ring->gops.size(); g-- > 0;) {
+		std::vector<rec_frame_t> &frames = ring->gops[g].frames;
+		for (size_t i = 0; i < frames.size(); i++) {
+			rec_frame_t *f = &frames[i];
+			if (f->buffer != orig || !f->pooled)
+				continue;
+			f->buffer = copy;
+			f->pooled = false;
+			ring->pooled--;
+			gst_buffer_unref(orig);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Swaps the pool buffers held in the rings for copies, so the encoders get
+ * theirs back. The copies are made without the lock, off the streaming threads.
+ */
+static void rec_detach(hal_rec_t *rec)
+{
+	std::vector<GstBuffer *> orig[REC_CAMERA_MAX];
+	{
+		std::lock_guard<std::mutex> lg(rec->mtx);
+		rec->detach = false;
+		for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+			rec_ring_t *ring = &rec->ring[ch];
+			for (size_t g = 0; g < ring->gops.size(); g++) {
+				std::vector<rec_frame_t> &frames = ring->gops[g].frames;
+				for (size_t i = 0; i < frames.size(); i++) {
+					if (frames[i].pooled)
+						orig[ch].push_back(gst_buffer_ref(frames[i].buffer));
+				}
+			}
+		}
+	}
+
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		for (size_t i = 0; i < orig[ch].size(); i++) {
+			GstBuffer *copy = gst_buffer_copy_deep(orig[ch][i]);
+			bool used;
+			{
+				std::lock_guard<std::mutex> lg(rec->mtx);
+				used = rec_replace(&rec->ring[ch], orig[ch][i], copy);
+			}
+			if (!used)
+				gst_buffer_unref(copy);
+			gst_buffer_unref(orig[ch][i]);
+		}
+	}
+}
+
+/* Same for a snapshot, only the writer thread has it. */
+static void rec_job_detach(rec_job_t *job)
+{
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		for (size_t i = 0; i < job->frames[ch].size(); i++) {
+			rec_frame_t *f = &job->frames[ch][i];
+			if (!f->pooled)
+				continue;
+			GstBuffer *copy = gst_buffer_copy_deep(f->buffer);
+			gst_buffer_unref(f->buffer);
+			f->buffer = copy;
+			f->pooled = false;
+		}
+	}
+}
+
+static void rec_job_free(rec_job_t *job)
+{
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		for (size_t i = 0; i < job->frames[ch].size(); i++)
+			gst_buffer_unref(job->frames[ch][i].buffer);
+	}
+	delete job;
+}
+
+static bool rec_write_buffer(FILE *fp, GstBuffer *buffer)
+{
+	GstMapInfo map;
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return false;
+
+	bool ok = fwrite(map.data, 1, map.size, fp) == map.size;
+	gst_buffer_unmap(buffer, &map);
+	return ok;
+}
+
+static void rec_write_cmd(FILE *fp, const rec_cmd_t *rc, uint64_t t0)
+{
+	const st_cmd_t *cmd = &rc->cmd;
+
+	fprintf(fp, "%+.1f cmd seq=%u ts=%u mask=0x%02x pos=", ((double)rc->t_us - t0) / 1000,
+			cmd->seq, cmd->ts, cmd->mask);
+	for (int i = 0; i < ST_JOINT_NUMBER; i++)
+		fprintf(fp, "%s%d", i ? "," : "", cmd->pos[i]);
+	fprintf(fp, "\n");
+}
+
+/* Video into one Annex-B file per camera, the log gets every frame and command by time. */
+static void rec_write_job(hal_rec_t *rec, rec_job_t *job)
+{
+	char prefix[256];
+	char path[320];
+	char date[32];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+	snprintf(prefix, sizeof(prefix), "%s/rec-%s", rec->dir.c_str(), date);
+
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		std::vector<rec_frame_t> &frames = job->frames[ch];
+		if (frames.empty())
+			continue;
+
+		/* keep the encoders supplied while the dump takes its time */
+		rec_detach(rec);
+
+		snprintf(path, sizeof(path), "%s-camera%d.%s", prefix, ch,
+				job->enc[ch] == HET_H265 ? "h265" : "h264");
+		FILE *fp = fopen(path, "wb");
+		if (!fp) {
+			printf("hal_rec: cannot create %s\n", path);
+			continue;
+		}
+		for (size_t i = 0; i < frames.size(); i++) {
+			if (!rec_write_buffer(fp, frames[i].buffer))
+				break;
+		}
+		fclose(fp);
+	}
+
+	snprintf(path, sizeof(path), "%s.log", prefix);
+	FILE *fp = fopen(path, "w");
+	if (!fp) {
+		printf("hal_rec: cannot create %s\n", path);
+		return;
+	}
+
+	/* times are ms relative to the trigger */
+	fprintf(fp, "# %s\n", job->reason.c_str());
+	size_t pos[REC_CAMERA_MAX] = {0};
+	size_t c = 0;
+	while (1) {
+		int best = -1;
+		uint64_t best_us = UINT64_MAX;
+		for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+			if (pos[ch] < job->frames[ch].size() && job->frames[ch][pos[ch]].pts_us < best_us) {
+				best = ch;
+				best_us = job->frames[ch][pos[ch]].pts_us;
+			}
+		}
+
+		if (c < job->cmds.size() && job->cmds[c].t_us <= best_us) {
+			rec_write_cmd(fp, &job->cmds[c++], job->t_us);
+			continue;
+		}
+		if (best < 0)
+			break;
+
+		const rec_frame_t *f = &job->frames[best][pos[best]++];
+		fprintf(fp, "%+.1f camera%d %s %zu\n", ((double)f->pts_us - job->t_us) / 1000, best,
+				f->key ? "key" : "delta", gst_buffer_get_size(f->buffer));
+	}
+	fclose(fp);
+
+	printf("hal_rec: dumped %s (%s)\n", prefix, job->reason.c_str());
+}
+
+static void rec_writer_proc()
+{
+	hal_rec_t *rec = &g_rec;
+
+	while (1) {
+		rec_job_t *job;
+		{
+			std::unique_lock<std::mutex> lk(rec->mtx);
+			rec->cond.wait(lk, [rec] { return rec->job || rec->detach || rec->b_exit; });
+			if (rec->b_exit)
+				break;
+			job = rec->job;
+		}
+
+		rec_detach(rec);
+		if (!job)
+			continue;
+
+		rec_job_detach(job);
+		rec_write_job(rec, job);
+
+		std::lock_guard<std::mutex> lg(rec->mtx);
+		rec->job = NULL;
+		rec_job_free(job);
+	}
+}
+
+int hal_rec_init(int seconds, const char *dir)
+{
+	hal_rec_t *rec = &g_rec;
+	if (seconds <= 0)
+		return -1;
+
+	rec->window_us = (uint64_t)seconds * 1000000;
+	rec->dir = dir ? dir : ".";
+	rec->cmd_head = 0;
+	rec->cmd_cnt = 0;
+	rec->job = NULL;
+	rec->detach = false;
+	rec->b_exit = false;
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		rec->ring[ch].enc = HET_H264;
+		rec->ring[ch].bytes = 0;
+		rec->ring[ch].pooled = 0;
+		rec->ring[ch].wait_key = true;
+		rec->ring[ch].skipped = 0;
+	}
+
+	rec->tid = std::thread(rec_writer_proc);
+	rec->enabled = true;
+	printf("hal_rec: recording the last %d s to %s on trigger\n", seconds, rec->dir.c_str());
+	return 0;
+}
+
+void hal_rec_push_video(int ch, hal_enc_type_e enc, GstBuffer *buffer, uint64_t pts_us, bool key)
+{
+	hal_rec_t *rec = &g_rec;
+	if (ch < 0 || ch >= REC_CAMERA_MAX)
+		return;
+
+	std::lock_guard<std::mutex> lg(rec->mtx);
+	if (!rec->enabled)
+		return;
+
+	rec_ring_t *ring = &rec->ring[ch];
+	if (key)
+		ring->wait_key = false;
+	if (ring->wait_key)
+		return;
+
+	/* encoder pools are small, holding seconds of their buffers would stall it */
+	bool pooled = buffer->pool != NULL;
+	if (pooled && ring->pooled >= REC_POOL_MAX) {
+		/* the frames after this one can't be decoded without it */
+		ring->wait_key = true;
+		ring->skipped++;
+		return;
+	}
+
+	rec_frame_t f;
+	f.buffer = gst_buffer_ref(buffer);
+	f.pts_us = pts_us ? pts_us : hal_now_us();
+	f.key = key;
+	f.pooled = pooled;
+	uint32_t size = gst_buffer_get_size(buffer);
+
+	if (pooled) {
+		ring->pooled++;
+		rec->detach = true;
+		rec->cond.notify_one();
+	}
+
+	if (key) {
+		ring->gops.push_back(rec_gop_t());
+		ring->gops.back().start_us = f.pts_us;
+		ring->gops.back().bytes = 0;
+	}
+	ring->enc = enc;
+	ring->gops.back().frames.push_back(f);
+	ring->gops.back().bytes += size;
+	ring->bytes += size;
+
+	/* drop the oldest GOP once the next one alone still covers the window */
+	while (ring->gops.size() > 1 && (ring->gops[1].start_us + rec->window_us <= f.pts_us ||
+			ring->bytes > REC_BYTES_MAX)) {
+		ring->bytes -= ring->gops.front().bytes;
+		rec_gop_release(ring, &ring->gops.front());
+		ring->gops.pop_front();
+	}
+}
+
+void hal_rec_log_cmd(const st_cmd_t *cmd)
+{
+	hal_rec_t *rec = &g_rec;
+	std::lock_guard<std::mutex> lg(rec->mtx);
+	if (!rec->enabled)
+		return;
+
+	if (rec->cmd_cnt == REC_CMD_MAX) {
+		rec->cmd_head = (rec->cmd_head + 1) % REC_CMD_MAX;
+		rec->cmd_cnt--;
+	}
+
+	rec_cmd_t *rc = &rec->cmd[(rec->cmd_head + rec->cmd_cnt) % REC_CMD_MAX];
+	rc->t_us = hal_now_us();
+	rc->cmd = *cmd;
+	rec->cmd_cnt++;
+}
+
+int hal_rec_trigger(const char *reason)
+{
+	hal_rec_t *rec = &g_rec;
+	std::lock_guard<std::mutex> lg(rec->mtx);
+	if (!rec->enabled)
+		return -1;
+
+	if (rec->job) {
+		printf("hal_rec: dump in progress, %s ignored\n", reason);
+		return -1;
+	}
+
+	/* only references are taken here, the writer thread does the copying */
+	rec_job_t *job = new rec_job_t;
+	job->reason = reason;
+	job->t_us = hal_now_us();
+	uint64_t since = job->t_us > rec->window_us ? job->t_us - rec->window_us : 0;
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		rec_ring_t *ring = &rec->ring[ch];
+		job->enc[ch] = ring->enc;
+		for (size_t g = 0; g < ring->gops.size(); g++) {
+			std::vector<rec_frame_t> &frames = ring->gops[g].frames;
+			for (size_t i = 0; i < frames.size(); i++) {
+				rec_frame_t f = frames[i];
+				gst_buffer_ref(f.buffer);
+				job->frames[ch].push_back(f);
+			}
+		}
+		if (!job->frames[ch].empty() && job->frames[ch][0].pts_us < since)
+			since = job->frames[ch][0].pts_us;
+	}
+
+	for (int i = 0; i < rec->cmd_cnt; i++) {
+		const rec_cmd_t *rc = &rec->cmd[(rec->cmd_head + i) % REC_CMD_MAX];
+		if (rc->t_us >= since)
+			job->cmds.push_back(*rc);
+	}
+
+	rec->job = job;
+	rec->cond.notify_one();
+	return 0;
+}
+
+void hal_rec_final()
+{
+	hal_rec_t *rec = &g_rec;
+	if (!rec->enabled)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lg(rec->mtx);
+		rec->enabled = false;
+		rec->b_exit = true;
+		rec->cond.notify_one();
+	}
+	if (rec->tid.joinable())
+		rec->tid.join();
+
+	std::lock_guard<std::mutex> lg(rec->mtx);
+	if (rec->job) {
+		rec_job_free(rec->job);
+		rec->job = NULL;
+	}
+	for (int ch = 0; ch < REC_CAMERA_MAX; ch++) {
+		rec_ring_t *ring = &rec->ring[ch];
+		if (ring->skipped)
+			printf("hal_rec: camera%d skipped[%u] frames short of pool buffers\n", ch, ring->skipped);
+		for (size_t g = 0; g < ring->gops.size(); g++)
+			rec_gop_release(ring, &ring->gops[g]);
+		ring->gops.clear();
+		ring->bytes = 0;
+		ring->wait_key = true;
+	}
+}
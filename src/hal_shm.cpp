@@ -0,0 +1,174 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_shm.h"
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_ALIGN(v, a)	(((v) + (a) - 1) / (a) * (a))
+
+static_assert(sizeof(hal_shm_frame_t) <= HAL_SHM_META_SIZE, "frame meta exceeds its slot header");
+
+struct hal_shm_ring {
+	std::string	name;
+	hal_shm_hdr_t	*hdr;
+	size_t		size;
+	uint64_t	frame_no;
+};
+
+static hal_shm_frame_t *shm_slot(const hal_shm_hdr_t *hdr, uint64_t frame_no)
+{
+	uint8_t *base = (uint8_t *)hdr + hdr->hdr_size;
+	return (hal_shm_frame_t *)(base + (size_t)(frame_no % hdr->slots) * hdr->slot_stride);
+}
+
+hal_shm_ring_t *hal_shm_create(const char *name, uint32_t slots, uint32_t slot_size)
+{
+	uint32_t hdr_size = SHM_ALIGN(sizeof(hal_shm_hdr_t), 64);
+	/* page aligned slots, so the data can be handed to anything that wants aligned buffers */
+	uint32_t slot_stride = SHM_ALIGN(HAL_SHM_META_SIZE + slot_size, 4096);
+	size_t size = hdr_size + (size_t)slots * slot_stride;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		printf("hal_shm: cannot create %s\n", name);
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		printf("hal_shm: cannot size %s to %zu bytes\n", name, size);
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	/* the object is zero filled, readers see magic last */
+	hal_shm_hdr_t *hdr = (hal_shm_hdr_t *)p;
+	hdr->version = HAL_SHM_VERSION;
+	hdr->slots = slots;
+	hdr->slot_size = slot_size;
+	hdr->slot_stride = slot_stride;
+	hdr->hdr_size = hdr_size;
+	__atomic_store_n(&hdr->magic, HAL_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	hal_shm_ring_t *ring = new hal_shm_ring_t;
+	ring->name = name;
+	ring->hdr = hdr;
+	ring->size = size;
+	ring->frame_no = 0;
+	return ring;
+}
+
+int hal_shm_write(hal_shm_ring_t *ring, const hal_shm_frame_t *meta, const void *data, uint32_t len)
+{
+	hal_shm_hdr_t *hdr = ring->hdr;
+	if (len > hdr->slot_size) {
+		__atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	uint64_t frame_no = ++ring->frame_no;
+	hal_shm_frame_t *f = shm_slot(hdr, frame_no);
+	uint32_t seq = f->seq;
+
+	__atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((uint8_t *)f + HAL_SHM_META_SIZE, data, len);
+	f->len = len;
+	f->frame_no = frame_no;
+	f->pts_us = meta->pts_us;
+	f->enc = meta->enc;
+	f->fourcc = meta->fourcc;
+	f->width = meta->width;
+	f->height = meta->height;
+	f->stride[0] = meta->stride[0];
+	f->stride[1] = meta->stride[1];
+	f->offset[0] = meta->offset[0];
+	f->offset[1] = meta->offset[1];
+	f->key = meta->key;
+
+	__atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->head, frame_no, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void hal_shm_destroy(hal_shm_ring_t *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->hdr, ring->size);
+	shm_unlink(ring->name.c_str());
+	delete ring;
+}
+
+const hal_shm_hdr_t *hal_shm_attach(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hal_shm_hdr_t)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	const hal_shm_hdr_t *hdr = (const hal_shm_hdr_t *)p;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != HAL_SHM_MAGIC || hdr->version != HAL_SHM_VERSION ||
+			(size_t)st.st_size < hdr->hdr_size + (size_t)hdr->slots * hdr->slot_stride) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	return hdr;
+}
+
+void hal_shm_detach(const hal_shm_hdr_t *hdr)
+{
+	if (hdr)
+		munmap((void *)hdr, hdr->hdr_size + (size_t)hdr->slots * hdr->slot_stride);
+}
+
+const hal_shm_frame_t *hal_shm_latest(const hal_shm_hdr_t *hdr, uint32_t *seq)
+{
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	if (head == 0)
+		return NULL;
+
+	const hal_shm_frame_t *f = shm_slot(hdr, head);
+	*seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+	if (*seq & 1)
+		return NULL;
+
+	return f;
+}
+
+const uint8_t *hal_shm_data(const hal_shm_frame_t *frame)
+{
+	return (const uint8_t *)frame + HAL_SHM_META_SIZE;
+}
+
+bool hal_shm_valid(const hal_shm_frame_t *frame, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&frame->seq, __ATOMIC_RELAXED) == seq;
+}
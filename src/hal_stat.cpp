@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_stat.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+void hal_hist_reset(hal_hist_t *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
+void hal_hist_add(hal_hist_t *hist, uint32_t us)
+{
+	int i = 0;
+	while (i < HAL_HIST_BUCKETS - 1 && (us >> (i + 1)))
+		i++;
+
+	hist->bucket[i]++;
+	hist->count++;
+	hist->sum_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+
+uint32_t hal_hist_percentile(const hal_hist_t *hist, int pct)
+{
+	if (hist->count == 0)
+		return 0;
+
+	uint64_t target = ((uint64_t)hist->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < HAL_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target)
+			return i == HAL_HIST_BUCKETS - 1 ? hist->max_us : (2u << i);
+	}
+
+	return hist->max_us;
+}
+
+void hal_hist_print(const char *name, const hal_hist_t *hist)
+{
+	if (hist->count == 0)
+		return;
+
+	printf("%s: n[%u] avg[%llu us] p50[<%u us] p99[<%u us] max[%u us]\n", name, hist->count,
+			(unsigned long long)(hist->sum_us / hist->count),
+			hal_hist_percentile(hist, 50), hal_hist_percentile(hist, 99), hist->max_us);
+}
+
+uint64_t hal_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -1,121 +1,2173 @@
 #include "hal_stream.h"
+#include "hal_stat.h"
+#include "hal_nal.h"
+#include "hal_rec.h"
+#include "hal_trace.h"
+#include "hal_shm.h"
 #include "gst/gst.h"
+#include "gst/app/gstappsink.h"
+#include "gst/video/video.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 
-#define CAMERA_NUM	3
+#define CAMERA_MAX	HAL_CAMERA_MAX
+#define LAYER_MAX	2
 
-#define CAMERA1_PIPELINE_SOURCE "v4l2src device=/dev/v4l/by-id/usb-HRY_USB_Camera_20191204-video-index0 ! image/jpeg, width=(int)640, height=(int)480, framerate=(fraction)30/1 ! videorate max-rate=30 ! avdec_mjpeg ! videoconvert ! v4l2h264enc min-force-key-unit-interval=1000000000 capture-io-mode=4 output-io-mode=4 extra-controls=encode,video_bitrate=1200000,video_bitrate_mode=0 name=encoder3 ! video/x-h264, stream-format=(string)byte-stream, level=(string)4, alighnment=(string)au ! h264parse config-interval=-1 ! appsink name=app-sink"
+/* Encoded frames waiting for the sender, shed at the edge when the uplink is slow. */
+#define FRAME_QUEUE_DEPTH	8
+#define STAT_INTERVAL_US	(10 * 1000000)
+#define PARAM_SETS_MAX		512
+/* At most one forced IDR per layer in this interval, whoever asks. */
+#define KEY_REQ_INTERVAL_US	(500 * 1000)
 
-#define CAMERA2_PIPELINE_SOURCE "v4l2src device=/dev/v4l/by-id/usb-Integrated_Webcam_Integrated_Webcam-video-index0 ! image/jpeg, width=(int)640, height=(int)480, framerate=(fraction)30/1 ! videorate max-rate=30 ! avdec_mjpeg ! videoconvert ! v4l2h264enc min-force-key-unit-interval=1000000000 capture-io-mode=4 output-io-mode=4 extra-controls=encode,video_bitrate=1200000,video_bitrate_mode=0 name=encoder3 ! video/x-h264, stream-format=(string)byte-stream, level=(string)4, alighnment=(string)au ! h264parse config-interval=-1 ! appsink name=app-sink"
+#define BITRATE_DEFAULT		1200000
+#define BITRATE_MIN		150000
+#define BITRATE_MAX		2000000
+/* Changes smaller than 1/BITRATE_HYST_DIV of the current rate are ignored. */
+#define BITRATE_HYST_DIV	10
+/* An increase must be asked for this long before it is applied, decreases apply at once. */
+#define BITRATE_UP_HOLD_US	(2 * 1000000)
 
-#define CAMERA3_PIPELINE_SOURCE "v4l2src device=/dev/v4l/by-id/usb-RYS_USB_Camera_200901010001-video-index0 ! image/jpeg, width=(int)640, height=(int)480, framerate=(fraction)30/1 ! videorate max-rate=30 ! avdec_mjpeg ! videoconvert ! v4l2h264enc min-force-key-unit-interval=1000000000 capture-io-mode=4 output-io-mode=4 extra-controls=encode,video_bitrate=1200000,video_bitrate_mode=0 name=encoder2 ! video/x-h264, stream-format=(string)byte-stream, level=(string)4, alighnment=(string)au ! h264parse config-interval=-1 ! appsink name=app-sink"
+/* The low layer is scaled down by this factor in both dimensions and has a fixed bitrate. */
+#define LOW_SCALE_DIV		2
+#define LOW_BITRATE		200000
+/* Below this share a camera with a low layer sends only that, above 5/4 of it both again. */
+#define HIGH_MIN_BPS		300000
 
-const char *g_camera_pipeline[] = {CAMERA1_PIPELINE_SOURCE, CAMERA2_PIPELINE_SOURCE, CAMERA3_PIPELINE_SOURCE};
+/* The mosaic is one frame of this size, camera 0's frame rate. */
+#define MOSAIC_WIDTH		1280
+#define MOSAIC_HEIGHT		720
+
+#define V4L2_BY_ID_DIR		"/dev/v4l/by-id/"
+#define TEST_SRC_DEVICE		"test"
+#define PIPELINE_DESC_MAX	2048
+/* Without viewers a pipeline is PAUSED, after this long READY, which releases the encoder buffers. */
+#define IDLE_GRACE_DEFAULT_S	30
+/* Shared memory export: a reader has this many frames' time before a slot is reused. */
+#define EXPORT_RAW_SLOTS	4
+#define EXPORT_ENC_SLOTS	8
+/* A PLAYING pipeline without a sample for this long is restarted, not before the start-up grace. */
+#define STALL_US		(3 * 1000000)
+#define STALL_GRACE_US		(10 * 1000000)
+#define WATCHDOG_INTERVAL_S	1
+/* Restart delays double from MIN to MAX, frames for RESTART_STABLE_US reset them. */
+#define RESTART_BACKOFF_MIN_S	1
+#define RESTART_BACKOFF_MAX_S	30
+#define RESTART_STABLE_US	(60 * 1000000)
+#define BENCH_WARMUP_S		1
+
+#define CAMERA_WIDTH_DEFAULT	640
+#define CAMERA_HEIGHT_DEFAULT	480
+#define CAMERA_FPS_DEFAULT	30
+
+typedef enum {
+	ENC_V4L2 = 0,
+	ENC_VAAPI,
+	ENC_X264,
+	ENC_NUM,
+} enc_kind_e;
+
+typedef enum {
+	CODEC_H264 = 0,
+	CODEC_H265,
+	CODEC_NUM,
+} codec_e;
+
+/* In probing order: hardware M2M, then VA-API, then software. */
+static const char *g_encoder_name[CODEC_NUM][ENC_NUM] = {
+	{"v4l2h264enc", "vaapih264enc", "x264enc"},
+	{"v4l2h265enc", "vaapih265enc", "x265enc"},
+};
+
+static const hal_enc_type_e g_codec_type[CODEC_NUM] = {HET_H264, HET_H265};
+
+typedef enum {
+	CAP_AUTO = 0,
+	CAP_MJPEG,	/* image/jpeg, avdec_mjpeg and videoconvert on the CPU */
+	CAP_HWJPEG,	/* image/jpeg, v4l2jpegdec and v4l2convert */
+	CAP_RAW,	/* NV12/YUY2 straight from the camera */
+	CAP_NUM,
+} capture_e;
+
+static const char *g_capture_name[CAP_NUM] = {"auto", "mjpeg", "hwjpeg", "raw"};
+
+/* Where a camera goes in the mosaic, in mosaic pixels. */
+typedef struct mosaic_rect {
+	int	x;
+	int	y;
+	int	w;
+	int	h;
+} mosaic_rect_t;
+
+typedef struct mosaic_layout {
+	const char	*name;
+	mosaic_rect_t	rect[CAMERA_MAX];
+} mosaic_layout_t;
+
+static const mosaic_layout_t g_mosaic_layouts[] = {
+	/* camera 0 large on the left, the others stacked on the right */
+	{"main", {{0, 0, 960, 720}, {960, 0, 320, 240}, {960, 240, 320, 240}}},
+	/* 2x2 grid, the fourth cell stays black */
+	{"grid", {{0, 0, 640, 360}, {640, 0, 640, 360}, {0, 360, 640, 360}}},
+	/* side by side on one row */
+	{"row", {{0, 180, 426, 360}, {427, 180, 426, 360}, {854, 180, 426, 360}}},
+};
+
+/* A capture path resolved against what the device and the plugins support. */
+typedef struct capture_path {
+	capture_e	cap;
+	const char	*raw_format;	/* CAP_RAW only */
+} capture_path_t;
+
+typedef struct frame_slot {
+	GstSample	*sample;
+	GstMapInfo	map;
+	hal_au_info_t	au;
+	uint64_t	enq_us;
+	uint64_t	pts_us;		/* capture time, CLOCK_MONOTONIC, 0 if unknown */
+	uint64_t	dts_us;
+} frame_slot_t;
+
+typedef struct frame_stats {
+	uint32_t	frames;
+	uint32_t	dropped;
+	uint32_t	flushed;
+	hal_hist_t	capture_us;	/* capture -> appsink */
+	hal_hist_t	queue_us;	/* appsink -> sender */
+	hal_hist_t	send_us;	/* time spent in the frame callback */
+	hal_hist_t	sent_us;	/* appsink -> sent */
+} frame_stats_t;
+
+struct CameraService;
+
+/* One encode of a camera: the high layer, and the scaled low layer with simulcast. */
+typedef struct camera_layer {
+	struct CameraService *cs;
+	hal_stream_type_e type;
+	char		name[16];
+	GstElement	*app_sink;
+	GstElement	*encoder;
+	GstElement	*valve;		/* simulcast only, stops the branch before the encoder */
+	uint64_t	key_req_us;
+	uint32_t	key_req_sent;
+	uint32_t	key_req_limited;
+	uint32_t	bitrate;	/* applied to the encoder */
+	bool		enabled;
+	std::thread	tid;
+	std::mutex	mtx;
+	std::condition_variable cond;
+	frame_slot_t	queue[FRAME_QUEUE_DEPTH];
+	int		head;
+	int		cnt;
+	bool		wait_idr;
+	bool		b_exit;
+	frame_stats_t	stats;
+	uint8_t		param_sets[PARAM_SETS_MAX];	/* latest (VPS +) SPS + PPS, Annex-B */
+	uint32_t	param_sets_len;
+	std::vector<uint8_t> scratch;
+} camera_layer_t;
 
 typedef struct CameraService {
   uint32_t	ch;
   GstElement	*pipeline;
-  GstElement	*app_sink;
+  codec_e	codec;
+  enc_kind_e	enc_kind;
+  capture_e	cap;		/* capture path of the current pipeline */
+  uint64_t	open_us;
+  camera_layer_t layers[LAYER_MAX];
+  int		layer_num;
+  /* guarded by bitrate_mtx */
+  uint32_t	target_bps;	/* from the network, 0 until known */
+  uint32_t	priority;
+  uint64_t	up_since_us;
+  uint32_t	layer_mask;	/* HAL_LAYER_*, asked for by the viewer */
+  uint32_t	auto_mask;	/* HAL_LAYER_*, allowed by the bandwidth */
+  /* owned by the main loop thread */
+  bool		started;	/* our connection joined the channel */
+  int		viewers;
+  guint		idle_timer;
+  GstState	state;
+  bool		prerolling;
+  guint		bus_watch;
+  bool		failed;		/* torn down, waiting for restart_timer or the device */
+  guint		restart_timer;
+  int		backoff_s;
+  uint32_t	restarts;
+  uint64_t	restart_us;
+  uint64_t	play_since_us;
+  /* set by the streaming threads, read by the watchdog */
+  std::atomic<uint64_t> sample_us;
+  /* outlive restarts so local readers keep their mapping */
+  GstElement	*export_sink;
+  hal_shm_ring_t *shm_raw;	/* written by the export branch */
+  hal_shm_ring_t *shm_enc;	/* written by the high layer's appsink */
+  /* guarded by mtx, set by the state changes, cleared by the first sample */
+  std::mutex	mtx;
+  uint64_t	preroll_us;
+  uint64_t	play_us;
 } CameraService;
 
-typedef struct media_device {
-	CameraService camera_services[CAMERA_NUM];
-	bool inited;
-	hal_frame_cb_t cb;
-} media_device_t;
+typedef struct media_device {
+	CameraService camera_services[CAMERA_MAX];
+	hal_camera_cfg_t cfg[CAMERA_MAX];
+	int count;
+	bool configured;
+	bool inited;
+	hal_frame_cb_t cb;
+	std::mutex bitrate_mtx;
+	GMainLoop *loop;
+	std::thread loop_tid;
+	guint watchdog;
+	int inotify_fd;
+	int inotify_wd;		/* /dev/v4l/by-id, -1 while it doesn't exist */
+	GIOChannel *inotify_ch;
+	guint inotify_watch;
+	GstAppSinkCallbacks callbacks;
+} media_device_t;
+
+typedef enum {
+	CAM_EV_START = 0,
+	CAM_EV_STOP,
+	CAM_EV_VIEWERS,
+	CAM_EV_PREROLLED,
+	CAM_EV_FAULT,
+} camera_event_e;
+
+typedef struct camera_event {
+	CameraService	*cs;
+	camera_event_e	type;
+	int		viewers;
+	char		reason[128];	/* CAM_EV_FAULT */
+} camera_event_t;
+
+static media_device_t g_media_deivce;
+static int g_idle_grace_s = IDLE_GRACE_DEFAULT_S;
+static bool g_preroll = false;
+static bool g_simulcast = false;
+static hal_enc_type_e g_codec = HET_H264;
+static bool g_mosaic = false;
+static mosaic_rect_t g_mosaic_rect[CAMERA_MAX];
+static int g_export = 0;
+static const char *g_state_name[] = {"VOID", "NULL", "READY", "PAUSED", "PLAYING"};
+
+static void frame_slot_release(frame_slot_t *slot)
+{
+	gst_buffer_unmap(gst_sample_get_buffer(slot->sample), &slot->map);
+	gst_sample_unref(slot->sample);
+	slot->sample = NULL;
+}
+
+static void frame_queue_flush(camera_layer_t *ly)
+{
+	while (ly->cnt > 0) {
+		frame_slot_release(&ly->queue[ly->head]);
+		ly->head = (ly->head + 1) % FRAME_QUEUE_DEPTH;
+		ly->cnt--;
+		ly->stats.flushed++;
+	}
+}
+
+static bool camera_has_param_sets(const camera_layer_t *ly, const hal_au_info_t *au)
+{
+	return au->sps.len && au->pps.len && (ly->cs->codec != CODEC_H265 || au->vps.len);
+}
+
+static void camera_cache_param_sets(camera_layer_t *ly, const hal_au_info_t *au)
+{
+	if (!camera_has_param_sets(ly, au) || au->vps.len + au->sps.len + au->pps.len > PARAM_SETS_MAX)
+		return;
+
+	uint8_t *p = ly->param_sets;
+	memcpy(p, au->vps.data, au->vps.len);
+	p += au->vps.len;
+	memcpy(p, au->sps.data, au->sps.len);
+	p += au->sps.len;
+	memcpy(p, au->pps.data, au->pps.len);
+	ly->param_sets_len = au->vps.len + au->sps.len + au->pps.len;
+}
+
+static void camera_post(CameraService *cs, camera_event_e type, int viewers);
+
+/* Startup and join latency, the part the operator sees as a black screen. */
+static void camera_log_first_frame(CameraService *cs, bool key)
+{
+	std::lock_guard<std::mutex> lg(cs->mtx);
+	uint64_t now = hal_now_us();
+
+	if (cs->preroll_us) {
+		printf("camera%u: pre-rolled, first frame %llu ms after start\n", cs->ch,
+				(unsigned long long)(now - cs->preroll_us) / 1000);
+		cs->preroll_us = 0;
+		camera_post(cs, CAM_EV_PREROLLED, 0);
+	}
+
+	if (cs->play_us && key) {
+		printf("camera%u: first IDR %llu ms after PLAYING\n", cs->ch,
+				(unsigned long long)(now - cs->play_us) / 1000);
+		cs->play_us = 0;
+	}
+}
+
+/*
+ * Drop policy: a delta frame that does not fit is dropped together with
+ * every following delta frame until the next IDR, since none of them could
+ * be decoded. An IDR that does not fit replaces the whole backlog.
+ */
+static void frame_queue_push(camera_layer_t *ly, frame_slot_t *in)
+{
+	bool key = in->au.key;
+
+	if (ly->type == HST_MAIN)
+		camera_log_first_frame(ly->cs, key);
+
+	std::lock_guard<std::mutex> lg(ly->mtx);
+
+	if (key)
+		camera_cache_param_sets(ly, &in->au);
+
+	if (!ly->enabled || (!key && (ly->wait_idr || ly->cnt == FRAME_QUEUE_DEPTH))) {
+		ly->wait_idr = true;
+		ly->stats.dropped++;
+		frame_slot_release(in);
+		return;
+	}
+
+	if (key) {
+		ly->wait_idr = false;
+		if (ly->cnt == FRAME_QUEUE_DEPTH)
+			frame_queue_flush(ly);
+	}
+
+	frame_slot_t *slot = &ly->queue[(ly->head + ly->cnt) % FRAME_QUEUE_DEPTH];
+	*slot = *in;
+	slot->enq_us = hal_now_us();
+	if (slot->pts_us && slot->enq_us > slot->pts_us)
+		hal_hist_add(&ly->stats.capture_us, slot->enq_us - slot->pts_us);
+	ly->cnt++;
+	ly->cond.notify_one();
+}
+
+/*
+ * Buffer timestamps are running time on the pipeline clock. The age of the
+ * timestamp on that clock is applied to CLOCK_MONOTONIC, so the result is
+ * right whatever clock the pipeline selected.
+ */
+static uint64_t camera_clock_to_mono(GstClockTime ts, GstClockTime base, GstClockTime now, uint64_t now_us)
+{
+	if (!GST_CLOCK_TIME_IS_VALID(ts))
+		return 0;
+
+	GstClockTimeDiff age = (GstClockTimeDiff)(now - (base + ts));
+	return (uint64_t)((int64_t)now_us - age / 1000);
+}
+
+static void camera_stamp(CameraService *cs, GstBuffer *buffer, frame_slot_t *slot)
+{
+	slot->pts_us = 0;
+	slot->dts_us = 0;
+
+	GstClock *clock = gst_element_get_clock(cs->pipeline);
+	if (!clock)
+		return;
+
+	GstClockTime base = gst_element_get_base_time(cs->pipeline);
+	GstClockTime now = gst_clock_get_time(clock);
+	uint64_t now_us = hal_now_us();
+	gst_object_unref(clock);
+
+	slot->pts_us = camera_clock_to_mono(GST_BUFFER_PTS(buffer), base, now, now_us);
+	slot->dts_us = camera_clock_to_mono(GST_BUFFER_DTS(buffer), base, now, now_us);
+	if (!slot->dts_us)
+		slot->dts_us = slot->pts_us;
+}
+
+static GstFlowReturn on_front_cam_data(GstAppSink *sink, gpointer data)
+{
+	camera_layer_t *layer = (camera_layer_t*)data;
+	frame_slot_t slot;
+
+	slot.sample = gst_app_sink_pull_sample(sink);
+	if (!slot.sample)
+		return GST_FLOW_ERROR;
+
+	GstBuffer *buffer = gst_sample_get_buffer(slot.sample);
+	if (!gst_buffer_map(buffer, &slot.map, GST_MAP_READ)) {
+		gst_sample_unref(slot.sample);
+		return GST_FLOW_OK;
+	}
+
+	if (hal_nal_parse_au(slot.map.data, slot.map.size, g_codec_type[layer->cs->codec], &slot.au) < 0) {
+		frame_slot_release(&slot);
+		return GST_FLOW_OK;
+	}
+
+	camera_stamp(layer->cs, buffer, &slot);
+	layer->cs->sample_us = hal_now_us();
+	if (layer->type == HST_MAIN)
+		hal_rec_push_video(layer->cs->ch, g_codec_type[layer->cs->codec], buffer, slot.pts_us, slot.au.key);
+	if (layer->type == HST_MAIN && layer->cs->shm_enc) {
+		hal_shm_frame_t meta;
+		memset(&meta, 0, sizeof(meta));
+		meta.pts_us = slot.pts_us;
+		meta.enc = g_codec_type[layer->cs->codec];
+		meta.key = slot.au.key;
+		hal_shm_write(layer->cs->shm_enc, &meta, slot.map.data, slot.map.size);
+	}
+	frame_queue_push(layer, &slot);
+	return GST_FLOW_OK;
+}
+
+/* Raw NV12 of the export branch into the camera's shared memory ring. */
+static GstFlowReturn on_export_data(GstAppSink *sink, gpointer data)
+{
+	CameraService *cs = (CameraService *)data;
+	frame_slot_t slot;
+
+	slot.sample = gst_app_sink_pull_sample(sink);
+	if (!slot.sample)
+		return GST_FLOW_ERROR;
+
+	GstBuffer *buffer = gst_sample_get_buffer(slot.sample);
+	if (!gst_buffer_map(buffer, &slot.map, GST_MAP_READ)) {
+		gst_sample_unref(slot.sample);
+		return GST_FLOW_OK;
+	}
+
+	const hal_camera_cfg_t *cfg = &g_media_deivce.cfg[cs->ch];
+	hal_shm_frame_t meta;
+	memset(&meta, 0, sizeof(meta));
+	camera_stamp(cs, buffer, &slot);
+	meta.pts_us = slot.pts_us;
+	meta.enc = HET_UNKNOWN;
+	meta.fourcc = HAL_SHM_FOURCC('N', 'V', '1', '2');
+
+	/* V4L2 buffers passed through keep the driver's padding, the meta says where the planes are */
+	GstVideoMeta *vmeta = gst_buffer_get_video_meta(buffer);
+	if (vmeta) {
+		meta.width = vmeta->width;
+		meta.height = vmeta->height;
+		meta.stride[0] = vmeta->stride[0];
+		meta.stride[1] = vmeta->stride[1];
+		meta.offset[0] = vmeta->offset[0];
+		meta.offset[1] = vmeta->offset[1];
+	} else {
+		meta.width = cfg->width;
+		meta.height = cfg->height;
+		meta.stride[0] = (cfg->width + 3) & ~3;
+		meta.stride[1] = meta.stride[0];
+		meta.offset[1] = meta.stride[0] * ((cfg->height + 1) & ~1);
+	}
+
+	hal_shm_write(cs->shm_raw, &meta, slot.map.data, slot.map.size);
+	frame_slot_release(&slot);
+	return GST_FLOW_OK;
+}
+
+static void camera_send_frame(media_device_t *md, camera_layer_t *ly, const frame_slot_t *slot)
+{
+	const hal_au_info_t *au = &slot->au;
+
+	hal_frame_t frame;
+	memset(&frame, 0, sizeof(hal_frame_t));
+	frame.m_frame_type = au->key ? HFT_I : HFT_P;
+	frame.m_data = (uint8_t *)au->payload;
+	frame.m_len = au->payload_len;
+	frame.m_enc_type = g_codec_type[ly->cs->codec];
+	frame.m_stream_type = ly->type;
+	frame.pts = slot->pts_us;
+	frame.dts = slot->dts_us;
+
+	/* An IDR without parameter sets is useless to a late joiner, prepend the cached ones. */
+	if (au->key && !camera_has_param_sets(ly, au)) {
+		std::lock_guard<std::mutex> lg(ly->mtx);
+		if (ly->param_sets_len) {
+			ly->scratch.resize(ly->param_sets_len + au->payload_len);
+			memcpy(&ly->scratch[0], ly->param_sets, ly->param_sets_len);
+			memcpy(&ly->scratch[ly->param_sets_len], au->payload, au->payload_len);
+			frame.m_data = &ly->scratch[0];
+			frame.m_len = ly->scratch.size();
+		}
+	}
+
+	if (md->cb)
+		md->cb(ly->cs->ch, &frame, NULL);
+}
+
+static void camera_print_stats(camera_layer_t *ly)
+{
+	char name[32];
+	frame_stats_t *st = &ly->stats;
+
+	printf("%s: frames[%u] dropped[%u] flushed[%u] key_req[%u] key_req_limited[%u]\n", ly->name,
+			st->frames, st->dropped, st->flushed, ly->key_req_sent, ly->key_req_limited);
+	snprintf(name, sizeof(name), "%s capture", ly->name);
+	hal_hist_print(name, &st->capture_us);
+	snprintf(name, sizeof(name), "%s queue", ly->name);
+	hal_hist_print(name, &st->queue_us);
+	snprintf(name, sizeof(name), "%s send", ly->name);
+	hal_hist_print(name, &st->send_us);
+	snprintf(name, sizeof(name), "%s sent", ly->name);
+	hal_hist_print(name, &st->sent_us);
+}
+
+static void camera_send_proc(camera_layer_t *ly)
+{
+	media_device_t *md = &g_media_deivce;
+	uint64_t report = hal_now_us() + STAT_INTERVAL_US;
+
+	while (1) {
+		frame_slot_t slot;
+		{
+			std::unique_lock<std::mutex> lk(ly->mtx);
+			ly->cond.wait(lk, [ly] { return ly->cnt > 0 || ly->b_exit; });
+			if (ly->b_exit)
+				break;
+
+			slot = ly->queue[ly->head];
+			ly->head = (ly->head + 1) % FRAME_QUEUE_DEPTH;
+			ly->cnt--;
+		}
+
+		uint64_t t0 = hal_now_us();
+		camera_send_frame(md, ly, &slot);
+		uint64_t t1 = hal_now_us();
+		frame_slot_release(&slot);
+
+		std::lock_guard<std::mutex> lg(ly->mtx);
+		ly->stats.frames++;
+		hal_hist_add(&ly->stats.queue_us, t0 - slot.enq_us);
+		hal_hist_add(&ly->stats.send_us, t1 - t0);
+		hal_hist_add(&ly->stats.sent_us, t1 - slot.enq_us);
+
+		if (t1 >= report) {
+			camera_print_stats(ly);
+			if (ly->type == HST_MAIN)
+				hal_trace_print(ly->cs->ch);
+			memset(&ly->stats, 0, sizeof(ly->stats));
+			report = t1 + STAT_INTERVAL_US;
+		}
+	}
+
+	std::lock_guard<std::mutex> lg(ly->mtx);
+	frame_queue_flush(ly);
+}
+
+static bool encoder_available(const char *name)
+{
+	GstElementFactory *factory = gst_element_factory_find(name);
+	if (!factory)
+		return false;
+
+	gst_object_unref(factory);
+	return true;
+}
+
+/*
+ * The configured encoder if it exists, otherwise the first available in
+ * probing order for the camera's codec, then for H.264.
+ */
+static int camera_probe_encoder(const hal_camera_cfg_t *cfg, codec_e *codec, enc_kind_e *kind)
+{
+	const char *want = cfg->encoder;
+
+	if (want[0]) {
+		for (int c = 0; c < CODEC_NUM; c++) {
+			for (int i = 0; i < ENC_NUM; i++) {
+				if (strcmp(want, g_encoder_name[c][i]) == 0 && encoder_available(want)) {
+					*codec = (codec_e)c;
+					*kind = (enc_kind_e)i;
+					return 0;
+				}
+			}
+		}
+		printf("media_device: encoder %s not usable, probing.\n", want);
+	}
+
+	for (int c = (cfg->codec == HET_H265) ? CODEC_H265 : CODEC_H264; c >= CODEC_H264; c--) {
+		for (int i = 0; i < ENC_NUM; i++) {
+			if (encoder_available(g_encoder_name[c][i])) {
+				*codec = (codec_e)c;
+				*kind = (enc_kind_e)i;
+				return 0;
+			}
+		}
+		if (c == CODEC_H265)
+			printf("media_device: no H.265 encoder, using H.264.\n");
+	}
+
+	return -1;
+}
+
+static bool camera_is_test(const hal_camera_cfg_t *cfg)
+{
+	return strcmp(cfg->device, TEST_SRC_DEVICE) == 0;
+}
+
+/* First raw format the device offers at the configured size and rate, NV12 preferred. */
+static const char *camera_probe_raw(const hal_camera_cfg_t *cfg)
+{
+	static const char *formats[] = {"NV12", "YUY2"};
+	const char *found = NULL;
+
+	GstElement *src = gst_element_factory_make("v4l2src", NULL);
+	if (!src)
+		return NULL;
+
+	g_object_set(src, "device", cfg->device, NULL);
+	if (gst_element_set_state(src, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
+		gst_object_unref(src);
+		return NULL;
+	}
+
+	GstPad *pad = gst_element_get_static_pad(src, "src");
+	GstCaps *caps = gst_pad_query_caps(pad, NULL);
+	for (size_t i = 0; caps && i < sizeof(formats) / sizeof(formats[0]) && !found; i++) {
+		char str[160];
+		snprintf(str, sizeof(str), "video/x-raw, format=(string)%s, width=(int)%d, height=(int)%d,"
+				" framerate=(fraction)%d/1", formats[i], cfg->width, cfg->height, cfg->fps);
+		GstCaps *want = gst_caps_from_string(str);
+		if (gst_caps_can_intersect(caps, want))
+			found = formats[i];
+		gst_caps_unref(want);
+	}
+
+	if (caps)
+		gst_caps_unref(caps);
+	gst_object_unref(pad);
+	gst_element_set_state(src, GST_STATE_NULL);
+	gst_object_unref(src);
+	return found;
+}
+
+/*
+ * v4l2jpegdec may be registered from a stale plugin cache or for a device
+ * that can't decode, so it has to open its device before it is used.
+ * -1 not probed, 0 unusable (or failed in a pipeline), 1 usable.
+ */
+static int g_hwjpeg = -1;
+
+static bool camera_hwjpeg_available()
+{
+	if (g_hwjpeg >= 0)
+		return g_hwjpeg > 0;
+
+	g_hwjpeg = 0;
+	GstElement *dec = gst_element_factory_make("v4l2jpegdec", NULL);
+	if (dec) {
+		if (gst_element_set_state(dec, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE)
+			g_hwjpeg = 1;
+		gst_element_set_state(dec, GST_STATE_NULL);
+		gst_object_unref(dec);
+	}
+	if (!g_hwjpeg)
+		printf("media_device: no usable v4l2jpegdec, decoding MJPEG in software.\n");
+	return g_hwjpeg > 0;
+}
+
+/*
+ * Resolves the requested capture path, falling back to the next one when the
+ * device or the plugins can't do it. Auto prefers hardware JPEG decode over
+ * raw since raw frames take several times the USB bandwidth of MJPEG.
+ * Returns -1 when an explicitly requested path had to be replaced by mjpeg.
+ */
+static int camera_resolve_capture(const hal_camera_cfg_t *cfg, capture_e want, capture_path_t *path)
+{
+	path->cap = CAP_MJPEG;
+	path->raw_format = NULL;
+
+	if (camera_is_test(cfg)) {
+		path->cap = CAP_RAW;
+		return 0;
+	}
+
+	if ((want == CAP_AUTO || want == CAP_HWJPEG) && camera_hwjpeg_available()) {
+		path->cap = CAP_HWJPEG;
+		return 0;
+	}
+
+	if (want == CAP_AUTO || want == CAP_RAW) {
+		path->raw_format = camera_probe_raw(cfg);
+		if (path->raw_format) {
+			path->cap = CAP_RAW;
+			return 0;
+		}
+	}
+
+	return (want == CAP_AUTO || want == CAP_MJPEG) ? 0 : -1;
+}
+
+static capture_e capture_from_name(const char *name)
+{
+	for (int i = 0; i < CAP_NUM; i++) {
+		if (strcmp(name, g_capture_name[i]) == 0)
+			return (capture_e)i;
+	}
+	return CAP_AUTO;
+}
+
+/* x264enc and x265enc share the option names used here. */
+static void camera_build_encoder(codec_e codec, enc_kind_e kind, const char *name, int bitrate, int fps,
+		bool zero_copy, char *enc, size_t size)
+{
+	const char *element = g_encoder_name[codec][kind];
+
+	switch (kind) {
+	case ENC_V4L2:
+		snprintf(enc, size, "%s min-force-key-unit-interval=500000000"
+				" capture-io-mode=4 output-io-mode=%s"
+				" extra-controls=encode,video_bitrate=%d,video_bitrate_mode=0 name=%s",
+				element, zero_copy ? "dmabuf-import" : "4", bitrate, name);
+		break;
+	case ENC_VAAPI:
+		snprintf(enc, size, "%s rate-control=cbr bitrate=%d"
+				" keyframe-period=%d name=%s", element, bitrate / 1000, fps * 2, name);
+		break;
+	default:
+		snprintf(enc, size, "%s tune=zerolatency speed-preset=ultrafast bitrate=%d"
+				" key-int-max=%d name=%s", element, bitrate / 1000, fps * 2, name);
+		break;
+	}
+}
+
+static const char *g_sink_caps[CODEC_NUM] = {
+	"video/x-h264, stream-format=(string)byte-stream, alignment=(string)au ! h264parse config-interval=-1",
+	"video/x-h265, stream-format=(string)byte-stream, alignment=(string)au ! h265parse config-interval=-1",
+};
+
+/* Keeps one branch of the tee, or one mosaic input, from stalling the others. */
+#define BRANCH_QUEUE	"queue max-size-buffers=2 max-size-bytes=0 max-size-time=0 leaky=downstream"
+
+/*
+ * Capture and conversion up to raw video. hw_convert allows v4l2convert, the
+ * hardware colorspace conversion that only makes sense in front of the M2M
+ * encoder. Returns true when the last element is a v4l2 device whose output
+ * the encoder can import as dmabuf.
+ */
+static bool camera_build_source(const hal_camera_cfg_t *cfg, const capture_path_t *path,
+		bool v4l2, bool hw_convert, char *src, size_t size)
+{
+	const char *convert = hw_convert ? "v4l2convert capture-io-mode=dmabuf" : "videoconvert";
+	bool zero_copy = false;
+
+	if (camera_is_test(cfg)) {
+		snprintf(src, size, "videotestsrc is-live=true pattern=ball"
+				" ! video/x-raw, width=(int)%d, height=(int)%d, framerate=(fraction)%d/1"
+				" ! videoconvert", cfg->width, cfg->height, cfg->fps);
+	} else if (path->cap == CAP_RAW) {
+		bool direct = v4l2 && strcmp(path->raw_format, "NV12") == 0;
+		zero_copy = direct || hw_convert;
+		snprintf(src, size, "v4l2src device=%s%s"
+				" ! video/x-raw, format=(string)%s, width=(int)%d, height=(int)%d, framerate=(fraction)%d/1"
+				" ! videorate max-rate=%d%s%s",
+				cfg->device, zero_copy ? " io-mode=dmabuf" : "", path->raw_format,
+				cfg->width, cfg->height, cfg->fps, cfg->fps,
+				direct ? "" : " ! ", direct ? "" : convert);
+	} else {
+		bool hw = path->cap == CAP_HWJPEG;
+		const char *sw_dec = encoder_available("avdec_mjpeg") ? "avdec_mjpeg" : "jpegdec";
+		zero_copy = hw && hw_convert;
+		snprintf(src, size, "v4l2src device=%s"
+				" ! image/jpeg, width=(int)%d, height=(int)%d, framerate=(fraction)%d/1"
+				" ! videorate max-rate=%d ! %s ! %s",
+				cfg->device, cfg->width, cfg->height, cfg->fps, cfg->fps,
+				hw ? "v4l2jpegdec" : sw_dec, hw ? convert : "videoconvert");
+	}
+
+	return zero_copy;
+}
+
+/*
+ * One encoder per camera, with simulcast a second one for the low layer, and
+ * with export_raw a branch ending in NV12 system memory for local readers.
+ */
+static void camera_build_pipeline(const hal_camera_cfg_t *cfg, const capture_path_t *path,
+		codec_e codec, enc_kind_e kind, bool simulcast, bool export_raw, char *desc, size_t size)
+{
+	char src[384];
+	char enc[256];
+	bool v4l2 = kind == ENC_V4L2;
+	bool hw_convert = v4l2 && encoder_available("v4l2convert");
+	bool zero_copy = camera_build_source(cfg, path, v4l2, hw_convert, src, sizeof(src));
+
+	camera_build_encoder(codec, kind, "encoder", BITRATE_DEFAULT, cfg->fps, zero_copy, enc, sizeof(enc));
+
+	if (!simulcast && !export_raw) {
+		snprintf(desc, size, "%s ! %s ! %s ! appsink name=app-sink", src, enc, g_sink_caps[codec]);
+		return;
+	}
+
+	int n = snprintf(desc, size, "%s ! tee name=t t. ! " BRANCH_QUEUE "%s ! %s ! %s ! appsink name=app-sink",
+			src, simulcast ? " ! valve name=valve" : "", enc, g_sink_caps[codec]);
+
+	if (simulcast && n < (int)size) {
+		/* The low layer scales in hardware when it can and then imports the result as dmabuf. */
+		char enc_low[256];
+		camera_build_encoder(codec, kind, "encoder-low", LOW_BITRATE, cfg->fps, hw_convert, enc_low, sizeof(enc_low));
+
+		n += snprintf(desc + n, size - n, " t. ! " BRANCH_QUEUE " ! valve name=valve-low ! %s"
+				" ! video/x-raw, width=(int)%d, height=(int)%d ! %s ! %s ! appsink name=app-sink-low",
+				hw_convert ? "v4l2convert capture-io-mode=dmabuf" : "videoscale",
+				cfg->width / LOW_SCALE_DIV, cfg->height / LOW_SCALE_DIV, enc_low, g_sink_caps[codec]);
+	}
+
+	/* a slow reader only makes the leaky queue drop, never the encoders */
+	if (export_raw && n < (int)size)
+		snprintf(desc + n, size - n, " t. ! " BRANCH_QUEUE " ! videoconvert"
+				" ! video/x-raw, format=(string)NV12 ! appsink name=export-sink");
+}
+
+/*
+ * All cameras scaled into one frame by compositor and encoded once. The
+ * sources convert in software since compositor blends in system memory.
+ */
+static int camera_build_mosaic(const hal_camera_cfg_t *cfg, int count, codec_e codec, enc_kind_e kind,
+		char *desc, size_t size)
+{
+	char enc[256];
+	bool hw_convert = kind == ENC_V4L2 && encoder_available("v4l2convert");
+	int n;
+
+	camera_build_encoder(codec, kind, "encoder", BITRATE_DEFAULT, cfg[0].fps, hw_convert, enc, sizeof(enc));
+
+	n = snprintf(desc, size, "compositor name=mix background=black");
+	for (int i = 0; i < count && n < (int)size; i++) {
+		const mosaic_rect_t *r = &g_mosaic_rect[i];
+		if (r->w <= 0)
+			continue;
+		n += snprintf(desc + n, size - n, " sink_%d::xpos=%d sink_%d::ypos=%d"
+				" sink_%d::width=%d sink_%d::height=%d",
+				i, r->x, i, r->y, i, r->w, i, r->h);
+	}
+	if (n < (int)size)
+		n += snprintf(desc + n, size - n, " ! video/x-raw, width=(int)%d, height=(int)%d, framerate=(fraction)%d/1"
+				" ! %s ! %s ! %s ! appsink name=app-sink",
+				MOSAIC_WIDTH, MOSAIC_HEIGHT, cfg[0].fps,
+				hw_convert ? "v4l2convert capture-io-mode=dmabuf" : "videoconvert", enc, g_sink_caps[codec]);
+
+	for (int i = 0; i < count && n < (int)size; i++) {
+		char src[384];
+		capture_path_t path;
+		capture_e want = capture_from_name(cfg[i].capture);
+
+		/* a camera without a rectangle is not opened at all */
+		if (g_mosaic_rect[i].w <= 0)
+			continue;
+
+		if (camera_resolve_capture(&cfg[i], want, &path) < 0)
+			printf("camera%d: %s capture not available, using mjpeg.\n", i, g_capture_name[want]);
+		camera_build_source(&cfg[i], &path, false, false, src, sizeof(src));
+		n += snprintf(desc + n, size - n, " %s ! " BRANCH_QUEUE " ! mix.sink_%d", src, i);
+	}
+
+	return n < (int)size ? 0 : -1;
+}
+
+static void camera_cfg_default(hal_camera_cfg_t *cfg, const char *device)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	if (device[0] == '/' || strcmp(device, TEST_SRC_DEVICE) == 0)
+		snprintf(cfg->device, sizeof(cfg->device), "%s", device);
+	else
+		snprintf(cfg->device, sizeof(cfg->device), V4L2_BY_ID_DIR "%s", device);
+	cfg->width = CAMERA_WIDTH_DEFAULT;
+	cfg->height = CAMERA_HEIGHT_DEFAULT;
+	cfg->fps = CAMERA_FPS_DEFAULT;
+	cfg->priority = 1;
+	cfg->codec = g_codec;
+}
+
+static int camera_load_cfg(media_device_t *md, const char *cfg_file)
+{
+	FILE *fp = fopen(cfg_file, "r");
+	if (!fp) {
+		printf("media_device: cannot open camera config %s\n", cfg_file);
+		return -1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), fp) && md->count < CAMERA_MAX) {
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char device[128];
+		char capture[16] = "";
+		char encoder[32] = "";
+		int width, height, fps, priority = 0;
+		int n = sscanf(line, "%127s %d %d %d %15s %31s %d", device, &width, &height, &fps,
+				capture, encoder, &priority);
+		if (n < 4 || width <= 0 || height <= 0 || fps <= 0)
+			continue;
+
+		hal_camera_cfg_t *cfg = &md->cfg[md->count++];
+		camera_cfg_default(cfg, device);
+		cfg->width = width;
+		cfg->height = height;
+		cfg->fps = fps;
+		/* "auto" keeps a column so the next one can follow */
+		if (n >= 5)
+			snprintf(cfg->capture, sizeof(cfg->capture), "%s", capture);
+		if (n >= 6 && strcmp(encoder, "h264") == 0)
+			cfg->codec = HET_H264;
+		else if (n >= 6 && strcmp(encoder, "h265") == 0)
+			cfg->codec = HET_H265;
+		else if (n >= 6 && strcmp(encoder, "auto") != 0)
+			snprintf(cfg->encoder, sizeof(cfg->encoder), "%s", encoder);
+		if (n >= 7 && priority > 0)
+			cfg->priority = priority;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* Capture devices in /dev/v4l/by-id, one per physical camera, sorted so the order is stable. */
+static void camera_discover(media_device_t *md)
+{
+	std::vector<std::string> names;
+
+	DIR *dir = opendir(V4L2_BY_ID_DIR);
+	if (dir) {
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (strstr(ent->d_name, "-video-index0"))
+				names.push_back(ent->d_name);
+		}
+		closedir(dir);
+	}
+
+	std::sort(names.begin(), names.end());
+	for (size_t i = 0; i < names.size() && md->count < CAMERA_MAX; i++)
+		camera_cfg_default(&md->cfg[md->count++], names[i].c_str());
+}
+
+int media_device_config(const char *cfg_file, int test_src)
+{
+	media_device_t *md = &g_media_deivce;
+	md->count = 0;
+	md->configured = true;
+
+	if (test_src > 0) {
+		for (int i = 0; i < test_src && i < CAMERA_MAX; i++)
+			camera_cfg_default(&md->cfg[md->count++], TEST_SRC_DEVICE);
+	} else if (cfg_file) {
+		if (camera_load_cfg(md, cfg_file) < 0)
+			return -1;
+	} else {
+		camera_discover(md);
+	}
+
+	/* camera 0 is the main view unless the config says otherwise */
+	if (md->count > 0 && (!cfg_file || test_src > 0))
+		md->cfg[0].priority = 2;
+
+	printf("media_device: %d camera(s) configured.\n", md->count);
+	return 0;
+}
+
+static camera_layer_t *camera_layer(CameraService *cs, hal_stream_type_e type)
+{
+	for (int i = 0; i < cs->layer_num; i++) {
+		if (cs->layers[i].type == type)
+			return &cs->layers[i];
+	}
+	return NULL;
+}
+
+static int camera_open_layer(camera_layer_t *ly, const char *sink_name, const char *enc_name,
+		const char *valve_name, GstAppSinkCallbacks *callbacks)
+{
+	CameraService *cs = ly->cs;
+
+	GstElement *app_sink = gst_bin_get_by_name(GST_BIN(cs->pipeline), sink_name);
+	if (!app_sink) {
+		printf("%s: pipeline has no %s.\n", ly->name, sink_name);
+		return -1;
+	}
+
+	/* no clock sync: frames are sent as soon as they are encoded */
+	g_object_set(app_sink, "emit-signals", FALSE, "sync", FALSE, NULL);
+	gst_app_sink_set_callbacks(GST_APP_SINK(app_sink), callbacks, ly, NULL);
+
+	/* a restart replaces the elements while key frame requests may come in */
+	std::lock_guard<std::mutex> lg(ly->mtx);
+	ly->app_sink = app_sink;
+	ly->encoder = gst_bin_get_by_name(GST_BIN(cs->pipeline), enc_name);
+	ly->valve = valve_name ? gst_bin_get_by_name(GST_BIN(cs->pipeline), valve_name) : NULL;
+	return 0;
+}
+
+static void camera_close_layer(camera_layer_t *ly)
+{
+	GstElement *elements[3];
+	{
+		std::lock_guard<std::mutex> lg(ly->mtx);
+		elements[0] = ly->encoder;
+		elements[1] = ly->valve;
+		elements[2] = ly->app_sink;
+		ly->encoder = NULL;
+		ly->valve = NULL;
+		ly->app_sink = NULL;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		if (elements[i])
+			gst_object_unref(elements[i]);
+	}
+}
+
+static int camera_open_export(CameraService *cs)
+{
+	GstAppSinkCallbacks callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.new_sample = on_export_data;
+
+	cs->export_sink = gst_bin_get_by_name(GST_BIN(cs->pipeline), "export-sink");
+	if (!cs->export_sink) {
+		printf("camera%u: pipeline has no export-sink.\n", cs->ch);
+		return -1;
+	}
+
+	g_object_set(cs->export_sink, "emit-signals", FALSE, "sync", FALSE, NULL);
+	gst_app_sink_set_callbacks(GST_APP_SINK(cs->export_sink), &callbacks, cs, NULL);
+	return 0;
+}
+
+static void camera_close_export(CameraService *cs)
+{
+	if (cs->export_sink)
+		gst_object_unref(cs->export_sink);
+	cs->export_sink = NULL;
+}
+
+static int camera_launch(CameraService *cs, const char *desc, bool simulcast, GstAppSinkCallbacks *callbacks)
+{
+	media_device_t *md = &g_media_deivce;
+	GError *err = NULL;
+
+	GstElement *pipeline = gst_parse_launch(desc, &err);
+	if (err) {
+		printf("camera%u: %s\n", cs->ch, err->message);
+		g_error_free(err);
+	}
+	if (!pipeline)
+		return -1;
+
+	/* bitrate and layer changes use the pipeline's elements under bitrate_mtx */
+	std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+	cs->pipeline = pipeline;
+	int ret = camera_open_layer(&cs->layers[0], "app-sink", "encoder",
+			simulcast ? "valve" : NULL, callbacks);
+	if (ret == 0 && simulcast)
+		ret = camera_open_layer(&cs->layers[1], "app-sink-low", "encoder-low", "valve-low", callbacks);
+	if (ret == 0 && cs->shm_raw)
+		ret = camera_open_export(cs);
+	if (ret < 0) {
+		for (int i = 0; i < LAYER_MAX; i++)
+			camera_close_layer(&cs->layers[i]);
+		camera_close_export(cs);
+		gst_object_unref(cs->pipeline);
+		cs->pipeline = NULL;
+		return -1;
+	}
+
+	cs->layer_num = simulcast ? 2 : 1;
+	hal_trace_attach(cs->ch, cs->pipeline);
+	return 0;
+}
+
+static int camera_open(CameraService *cs, const hal_camera_cfg_t *cfg, GstAppSinkCallbacks *callbacks)
+{
+	char desc[PIPELINE_DESC_MAX];
+	capture_path_t path;
+
+	if (camera_probe_encoder(cfg, &cs->codec, &cs->enc_kind) < 0) {
+		printf("camera%u: no video encoder available.\n", cs->ch);
+		return -1;
+	}
+
+	capture_e want = capture_from_name(cfg->capture);
+	if (camera_resolve_capture(cfg, want, &path) < 0)
+		printf("camera%u: %s capture not available, using mjpeg.\n", cs->ch, g_capture_name[want]);
+	camera_build_pipeline(cfg, &path, cs->codec, cs->enc_kind, g_simulcast, cs->shm_raw != NULL,
+			desc, sizeof(desc));
+	cs->cap = path.cap;
+	cs->open_us = hal_now_us();
+	if (camera_launch(cs, desc, g_simulcast, callbacks) < 0)
+		return -1;
+
+	printf("camera%u: %s %dx%d@%d %s %s%s\n", cs->ch, cfg->device, cfg->width, cfg->height,
+			cfg->fps, g_capture_name[path.cap], g_encoder_name[cs->codec][cs->enc_kind],
+			g_simulcast ? " simulcast" : "");
+	return 0;
+}
+
+/* The mosaic is camera 0, the other cameras have no pipeline of their own. */
+static int camera_open_mosaic(CameraService *cs, const hal_camera_cfg_t *cfg, int count,
+		GstAppSinkCallbacks *callbacks)
+{
+	char desc[PIPELINE_DESC_MAX];
+
+	if (camera_probe_encoder(&cfg[0], &cs->codec, &cs->enc_kind) < 0) {
+		printf("camera%u: no video encoder available.\n", cs->ch);
+		return -1;
+	}
+
+	if (camera_build_mosaic(cfg, count, cs->codec, cs->enc_kind, desc, sizeof(desc)) < 0) {
+		printf("camera%u: mosaic pipeline too long.\n", cs->ch);
+		return -1;
+	}
+	if (camera_launch(cs, desc, false, callbacks) < 0)
+		return -1;
+
+	printf("camera%u: mosaic of %d camera(s) %dx%d@%d %s\n", cs->ch, count, MOSAIC_WIDTH, MOSAIC_HEIGHT,
+			cfg[0].fps, g_encoder_name[cs->codec][cs->enc_kind]);
+	return 0;
+}
+
+/*
+ * Returns 1 without a request when the last one is less than min_interval_us
+ * ago; the check and the new timestamp are one step so concurrent requests
+ * can't both pass.
+ */
+static int camera_force_key_unit(camera_layer_t *ly, uint64_t min_interval_us)
+{
+	GstPad *pad;
+	uint32_t count;
+	{
+		std::lock_guard<std::mutex> lg(ly->mtx);
+		uint64_t now = hal_now_us();
+		if (min_interval_us && ly->key_req_us && now - ly->key_req_us < min_interval_us) {
+			ly->key_req_limited++;
+			return 1;
+		}
+		if (!ly->encoder)
+			return -1;
+		pad = gst_element_get_static_pad(ly->encoder, "src");
+		ly->key_req_us = now;
+		count = ++ly->key_req_sent;
+	}
+
+	/* Upstream GstForceKeyUnit, all-headers so SPS/PPS travel with the IDR. */
+	GstStructure *st = gst_structure_new("GstForceKeyUnit",
+			"running-time", GST_TYPE_CLOCK_TIME, GST_CLOCK_TIME_NONE,
+			"all-headers", G_TYPE_BOOLEAN, TRUE,
+			"count", G_TYPE_UINT, count, NULL);
+	GstEvent *event = gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, st);
+
+	gboolean ret = gst_pad_send_event(pad, event);
+	gst_object_unref(pad);
+
+	return ret ? 0 : -1;
+}
+
+static void camera_post_fault(CameraService *cs, const char *reason);
+
+static void camera_set_state(CameraService *cs, GstState state)
+{
+	if (cs->state == state || !cs->pipeline)
+		return;
+
+	uint64_t t0 = hal_now_us();
+	GstStateChangeReturn ret = gst_element_set_state(cs->pipeline, state);
+	printf("camera%u: %s -> %s viewers[%d]%s %llu us\n", cs->ch, g_state_name[cs->state],
+			g_state_name[state], cs->viewers, ret == GST_STATE_CHANGE_FAILURE ? " failed" : "",
+			(unsigned long long)(hal_now_us() - t0));
+	cs->state = state;
+	if (state == GST_STATE_PLAYING)
+		cs->play_since_us = t0;
+	if (ret == GST_STATE_CHANGE_FAILURE) {
+		char reason[64];
+		snprintf(reason, sizeof(reason), "state change to %s failed", g_state_name[state]);
+		camera_post_fault(cs, reason);
+	}
+
+	{
+		std::lock_guard<std::mutex> lg(cs->mtx);
+		cs->play_us = (state == GST_STATE_PLAYING) ? t0 : 0;
+	}
+
+	if (state == GST_STATE_PLAYING)
+		return;
+
+	/* frames from before a pause are stale, resume on an IDR */
+	for (int i = 0; i < cs->layer_num; i++) {
+		camera_layer_t *ly = &cs->layers[i];
+		std::lock_guard<std::mutex> lg(ly->mtx);
+		frame_queue_flush(ly);
+		ly->wait_idr = true;
+	}
+}
+
+/* Pre-rolled pipelines idle in PAUSED with the device open and the encoder warm. */
+static GstState camera_idle_state()
+{
+	return g_preroll ? GST_STATE_PAUSED : GST_STATE_READY;
+}
+
+static gboolean camera_idle_timeout(gpointer data)
+{
+	CameraService *cs = (CameraService *)data;
+
+	cs->idle_timer = 0;
+	camera_set_state(cs, camera_idle_state());
+	return FALSE;
+}
+
+/* Local readers of the raw export need frames whether or not anyone watches remotely. */
+static bool camera_always_on(CameraService *cs)
+{
+	return g_idle_grace_s < 0 || cs->shm_raw;
+}
+
+/* Runs on the main loop thread, the only one changing pipeline states after init. */
+static void camera_update(CameraService *cs)
+{
+	bool watched = cs->started && (cs->viewers > 0 || camera_always_on(cs));
+
+	/* let the pre-roll reach its first frame unless someone is waiting for it */
+	if (cs->prerolling && !watched)
+		return;
 
-static media_device_t g_media_deivce;
+	if (!cs->started) {
+		camera_set_state(cs, camera_idle_state());
+	} else if (cs->viewers > 0 || camera_always_on(cs)) {
+		if (cs->idle_timer) {
+			g_source_remove(cs->idle_timer);
+			cs->idle_timer = 0;
+		}
+		if (cs->state != GST_STATE_PLAYING) {
+			camera_set_state(cs, GST_STATE_PLAYING);
+			/* not rate limited, the new viewer can't decode anything before it */
+			for (int i = 0; i < cs->layer_num; i++)
+				camera_force_key_unit(&cs->layers[i], 0);
+		}
+		return;
+	} else if (cs->state == GST_STATE_PLAYING) {
+		camera_set_state(cs, GST_STATE_PAUSED);
+		if (!cs->idle_timer)
+			cs->idle_timer = g_timeout_add_seconds(g_idle_grace_s, camera_idle_timeout, cs);
+		return;
+	}
+
+	if (cs->idle_timer) {
+		g_source_remove(cs->idle_timer);
+		cs->idle_timer = 0;
+	}
+}
+
+static gboolean camera_bus_cb(GstBus *bus, GstMessage *msg, gpointer data)
+{
+	CameraService *cs = (CameraService *)data;
+	char reason[128];
+
+	switch (GST_MESSAGE_TYPE(msg)) {
+	case GST_MESSAGE_ERROR: {
+		GError *err = NULL;
+		gchar *debug = NULL;
+		gst_message_parse_error(msg, &err, &debug);
+		snprintf(reason, sizeof(reason), "error: %s", err ? err->message : "unknown");
+		g_clear_error(&err);
+		g_free(debug);
+		camera_post_fault(cs, reason);
+		break;
+	}
+	case GST_MESSAGE_EOS:
+		camera_post_fault(cs, "end of stream");
+		break;
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
+static void camera_attach(CameraService *cs)
+{
+	GstBus *bus = gst_element_get_bus(cs->pipeline);
+	cs->bus_watch = gst_bus_add_watch(bus, camera_bus_cb, cs);
+	gst_object_unref(bus);
+}
 
-static GstFlowReturn on_front_cam_data(GstElement *sink, void *data)
+/* Back to the state of a camera that failed to open, the send threads keep running. */
+static void camera_teardown(CameraService *cs)
 {
 	media_device_t *md = &g_media_deivce;
-	CameraService *camera_service = (CameraService*)data;
-	uint32_t ch = camera_service->ch;
-	GstSample *sample;
-	GstBuffer *buffer;
-	GstMapInfo info;
-
-	uint8_t *buf;
-	g_signal_emit_by_name(sink, "pull-sample", &sample);
-
-	if(sample) {
-		buffer = gst_sample_get_buffer(sample);
-		gst_buffer_map(buffer, &info, GST_MAP_READ);
-		buf = info.data + 6;
-
-		hal_frame_t frame;
-		memset(&frame, 0, sizeof(hal_frame_t));
-		frame.m_frame_type = (buf[4] & 0x05) == 0x05 ? HFT_I : HFT_B;
-		frame.m_data = buf;
-		frame.m_len = info.size - 6;
-		frame.m_enc_type = HET_H264;
-
-		if (md->cb)
-			md->cb(ch, &frame, NULL);
-
-		gst_buffer_unmap(buffer, &info);
-		gst_sample_unref(sample);
-		return GST_FLOW_OK;
+
+	if (cs->bus_watch) {
+		g_source_remove(cs->bus_watch);
+		cs->bus_watch = 0;
+	}
+	if (cs->idle_timer) {
+		g_source_remove(cs->idle_timer);
+		cs->idle_timer = 0;
+	}
+
+	gst_element_set_state(cs->pipeline, GST_STATE_NULL);
+	hal_trace_detach(cs->ch);
+	{
+		/* bitrate and layer changes use the pipeline's elements under bitrate_mtx */
+		std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+		for (int i = 0; i < cs->layer_num; i++) {
+			camera_layer_t *ly = &cs->layers[i];
+			camera_close_layer(ly);
+
+			std::lock_guard<std::mutex> lk(ly->mtx);
+			frame_queue_flush(ly);
+			ly->wait_idr = true;
+			ly->bitrate = (ly->type == HST_SUB) ? LOW_BITRATE : BITRATE_DEFAULT;
+		}
+
+		camera_close_export(cs);
+		gst_object_unref(cs->pipeline);
+		cs->pipeline = NULL;
+	}
+	cs->state = GST_STATE_NULL;
+	cs->prerolling = false;
+
+	std::lock_guard<std::mutex> lg(cs->mtx);
+	cs->preroll_us = 0;
+	cs->play_us = 0;
+}
+
+static void media_device_rebalance(media_device_t *md);
+static gboolean camera_restart_timeout(gpointer data);
+
+static void camera_schedule_restart(CameraService *cs)
+{
+	cs->restart_timer = g_timeout_add_seconds(cs->backoff_s, camera_restart_timeout, cs);
+	cs->backoff_s = std::min(cs->backoff_s * 2, RESTART_BACKOFF_MAX_S);
+}
+
+static void camera_restart(CameraService *cs)
+{
+	media_device_t *md = &g_media_deivce;
+	const hal_camera_cfg_t *cfg = &md->cfg[cs->ch];
+
+	/* unplugged: the next retry or the by-id watch brings it back */
+	if (!g_mosaic && !camera_is_test(cfg) && access(cfg->device, F_OK) != 0) {
+		camera_schedule_restart(cs);
+		return;
+	}
+
+	int ret = g_mosaic ? camera_open_mosaic(cs, md->cfg, md->count, &md->callbacks) :
+			camera_open(cs, cfg, &md->callbacks);
+	if (ret < 0) {
+		printf("camera%u: restart failed, next try in %d s\n", cs->ch, cs->backoff_s);
+		camera_schedule_restart(cs);
+		return;
+	}
+
+	camera_attach(cs);
+	cs->failed = false;
+	cs->restarts++;
+	cs->restart_us = hal_now_us();
+	printf("camera%u: restarted, %u restart(s)\n", cs->ch, cs->restarts);
+
+	{
+		std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+		for (int i = 0; i < cs->layer_num; i++) {
+			camera_layer_t *ly = &cs->layers[i];
+			if (ly->valve && !ly->enabled)
+				g_object_set(ly->valve, "drop", TRUE, NULL);
+		}
+		media_device_rebalance(md);
+	}
+
+	/* plays again if watched, which forces the IDR the viewers need */
+	camera_update(cs);
+}
+
+static gboolean camera_restart_timeout(gpointer data)
+{
+	CameraService *cs = (CameraService *)data;
+
+	cs->restart_timer = 0;
+	camera_restart(cs);
+	return FALSE;
+}
+
+/* Only this camera's pipeline is rebuilt, the others keep streaming. */
+static void camera_fail(CameraService *cs, const char *reason)
+{
+	if (cs->failed || !cs->pipeline)
+		return;
+
+	/* a hardware decoder that never produced a frame is not retried, the restart decodes in software */
+	if (cs->cap == CAP_HWJPEG && cs->sample_us < cs->open_us) {
+		printf("camera%u: v4l2jpegdec failed, using software decoding.\n", cs->ch);
+		g_hwjpeg = 0;
+	}
+
+	char dump[160];
+	snprintf(dump, sizeof(dump), "camera%u %s", cs->ch, reason);
+	printf("camera%u: %s, restarting in %d s\n", cs->ch, reason, cs->backoff_s);
+	hal_rec_trigger(dump);
+
+	camera_teardown(cs);
+	cs->failed = true;
+	camera_schedule_restart(cs);
+}
+
+static void camera_watch_devices(media_device_t *md);
+
+static gboolean camera_devices_cb(GIOChannel *ch, GIOCondition cond, gpointer data)
+{
+	media_device_t *md = (media_device_t *)data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool created = false;
+
+	ssize_t n = read(md->inotify_fd, buf, sizeof(buf));
+	for (ssize_t off = 0; off < n; ) {
+		const struct inotify_event *ev = (const struct inotify_event *)(buf + off);
+		if (ev->mask & IN_IGNORED)
+			md->inotify_wd = -1;
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			created = true;
+		off += sizeof(*ev) + ev->len;
+	}
+
+	/* a camera came back, retry the waiting ones now instead of after their backoff */
+	for (int i = 0; created && i < md->count; i++) {
+		CameraService *cs = &md->camera_services[i];
+		if (!cs->failed || !cs->restart_timer)
+			continue;
+		g_source_remove(cs->restart_timer);
+		cs->restart_timer = 0;
+		cs->backoff_s = RESTART_BACKOFF_MIN_S;
+		camera_restart(cs);
+	}
+
+	return TRUE;
+}
+
+/* The by-id directory disappears with the last camera, the watchdog re-adds the watch. */
+static void camera_watch_devices(media_device_t *md)
+{
+	if (md->inotify_fd < 0) {
+		md->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (md->inotify_fd < 0)
+			return;
+		md->inotify_ch = g_io_channel_unix_new(md->inotify_fd);
+		md->inotify_watch = g_io_add_watch(md->inotify_ch, G_IO_IN, camera_devices_cb, md);
+	}
+
+	if (md->inotify_wd < 0)
+		md->inotify_wd = inotify_add_watch(md->inotify_fd, V4L2_BY_ID_DIR, IN_CREATE | IN_MOVED_TO);
+}
+
+static gboolean media_device_watchdog(gpointer data)
+{
+	media_device_t *md = (media_device_t *)data;
+	uint64_t now = hal_now_us();
+
+	for (int i = 0; i < md->count; i++) {
+		CameraService *cs = &md->camera_services[i];
+		if (!cs->pipeline || cs->state != GST_STATE_PLAYING)
+			continue;
+
+		/* with every valve closed no frame reaches the appsinks, the grace restarts on reopening */
+		bool flowing = false;
+		for (int j = 0; j < cs->layer_num; j++) {
+			std::lock_guard<std::mutex> lg(cs->layers[j].mtx);
+			flowing |= cs->layers[j].enabled;
+		}
+		if (!flowing) {
+			cs->play_since_us = now;
+			continue;
+		}
+
+		uint64_t last = cs->sample_us;
+		if (now > std::max(last, cs->play_since_us + STALL_GRACE_US) + STALL_US) {
+			char reason[64];
+			snprintf(reason, sizeof(reason), "no frame for %llu ms",
+					(unsigned long long)(now - std::max(last, cs->play_since_us)) / 1000);
+			camera_fail(cs, reason);
+			continue;
+		}
+
+		if (cs->restarts && now - cs->restart_us > RESTART_STABLE_US && now - last < STALL_US)
+			cs->backoff_s = RESTART_BACKOFF_MIN_S;
+	}
+
+	camera_watch_devices(md);
+	return TRUE;
+}
+
+static gboolean camera_event_idle(gpointer data)
+{
+	camera_event_t *ev = (camera_event_t *)data;
+	CameraService *cs = ev->cs;
+
+	switch (ev->type) {
+	case CAM_EV_START:
+		cs->started = true;
+		break;
+	case CAM_EV_STOP:
+		cs->started = false;
+		break;
+	case CAM_EV_VIEWERS:
+		cs->viewers = ev->viewers;
+		break;
+	case CAM_EV_PREROLLED:
+		cs->prerolling = false;
+		break;
+	case CAM_EV_FAULT:
+		camera_fail(cs, ev->reason);
+		delete ev;
+		return FALSE;
 	}
 
-	return GST_FLOW_ERROR;
+	camera_update(cs);
+	delete ev;
+	return FALSE;
+}
+
+static void camera_post(CameraService *cs, camera_event_e type, int viewers)
+{
+	camera_event_t *ev = new camera_event_t;
+	ev->cs = cs;
+	ev->type = type;
+	ev->viewers = viewers;
+	ev->reason[0] = '\0';
+	g_idle_add(camera_event_idle, ev);
+}
+
+/* From any thread, the pipeline is torn down on the main loop. */
+static void camera_post_fault(CameraService *cs, const char *reason)
+{
+	camera_event_t *ev = new camera_event_t;
+	ev->cs = cs;
+	ev->type = CAM_EV_FAULT;
+	ev->viewers = 0;
+	snprintf(ev->reason, sizeof(ev->reason), "%s", reason);
+	g_idle_add(camera_event_idle, ev);
+}
+
+static int camera_post_event(int ch, camera_event_e type, int viewers)
+{
+	media_device_t *md = &g_media_deivce;
+	/* a failed camera still follows its viewers, a restart picks up the state */
+	if (ch < 0 || ch >= md->count || !md->inited || !md->camera_services[ch].layer_num)
+		return -1;
+
+	camera_post(&md->camera_services[ch], type, viewers);
+	return 0;
+}
+
+static void media_device_loop_proc(media_device_t *md)
+{
+	g_main_loop_run(md->loop);
+}
+
+static void camera_init_layer(CameraService *cs, camera_layer_t *ly, hal_stream_type_e type)
+{
+	ly->cs = cs;
+	ly->type = type;
+	snprintf(ly->name, sizeof(ly->name), "camera%u%s", cs->ch, type == HST_SUB ? "-low" : "");
+	ly->app_sink = NULL;
+	ly->encoder = NULL;
+	ly->valve = NULL;
+	ly->key_req_us = 0;
+	ly->key_req_sent = 0;
+	ly->key_req_limited = 0;
+	ly->bitrate = (type == HST_SUB) ? LOW_BITRATE : BITRATE_DEFAULT;
+	ly->enabled = true;
+	ly->head = 0;
+	ly->cnt = 0;
+	ly->wait_idr = false;
+	ly->b_exit = false;
+	ly->param_sets_len = 0;
+	memset(&ly->stats, 0, sizeof(ly->stats));
 }
 
+/* /camera<N>-raw and /camera<N>-enc, see hal_shm.h for the layout. */
+static void camera_create_export(CameraService *cs, const hal_camera_cfg_t *cfg)
+{
+	char name[32];
+
+	cs->shm_raw = NULL;
+	cs->shm_enc = NULL;
+	if (g_mosaic && cs->ch > 0)
+		return;
+
+	/* the mosaic's raw frames never leave the compositor branch, only its stream is exported */
+	if ((g_export & HAL_EXPORT_RAW) && !g_mosaic) {
+		snprintf(name, sizeof(name), "/camera%u-raw", cs->ch);
+		cs->shm_raw = hal_shm_create(name, EXPORT_RAW_SLOTS, cfg->width * cfg->height * 2);
+	}
+	if (g_export & HAL_EXPORT_ENCODED) {
+		int pixels = g_mosaic ? MOSAIC_WIDTH * MOSAIC_HEIGHT : cfg->width * cfg->height;
+		snprintf(name, sizeof(name), "/camera%u-enc", cs->ch);
+		cs->shm_enc = hal_shm_create(name, EXPORT_ENC_SLOTS, pixels);
+	}
+}
 
 int media_device_init(hal_frame_cb_t cb)
 {
 	media_device_t *md = &g_media_deivce;
-	memset(md, 0, sizeof(media_device_t));
-	md->inited = true;
 	md->cb = cb;
 
 	gst_init(NULL, NULL);
 
-	for (int i = 0; i < CAMERA_NUM; i++) {
-		md->camera_services[i].ch = i;
-		md->camera_services[i].pipeline = gst_parse_launch(g_camera_pipeline[i], NULL);
-		md->camera_services[i].app_sink = gst_bin_get_by_name(GST_BIN(md->camera_services[i].pipeline), "app-sink");
-		g_signal_connect(md->camera_services[i].app_sink, "new-sample", G_CALLBACK(on_front_cam_data), &md->camera_services[i]);
-		g_object_set(md->camera_services[i].app_sink, "emit-signals", TRUE, NULL);
+	if (!md->configured)
+		media_device_config(NULL, 0);
+
+	memset(&md->callbacks, 0, sizeof(md->callbacks));
+	md->callbacks.new_sample = on_front_cam_data;
+	md->inotify_fd = -1;
+	md->inotify_wd = -1;
+	md->inotify_ch = NULL;
+	md->inotify_watch = 0;
+
+	for (int i = 0; i < md->count; i++) {
+		CameraService *cs = &md->camera_services[i];
+		cs->ch = i;
+		cs->pipeline = NULL;
+		cs->layer_num = 0;
+		cs->codec = CODEC_H264;
+		camera_init_layer(cs, &cs->layers[0], HST_MAIN);
+		camera_init_layer(cs, &cs->layers[1], HST_SUB);
+		cs->target_bps = 0;
+		cs->priority = md->cfg[i].priority;
+		cs->up_since_us = 0;
+		cs->layer_mask = HAL_LAYER_HIGH | HAL_LAYER_LOW;
+		cs->auto_mask = HAL_LAYER_HIGH | HAL_LAYER_LOW;
+		cs->started = false;
+		cs->viewers = 0;
+		cs->idle_timer = 0;
+		cs->state = GST_STATE_NULL;
+		cs->prerolling = false;
+		cs->bus_watch = 0;
+		cs->failed = false;
+		cs->restart_timer = 0;
+		cs->backoff_s = RESTART_BACKOFF_MIN_S;
+		cs->restarts = 0;
+		cs->restart_us = 0;
+		cs->play_since_us = 0;
+		cs->sample_us = 0;
+		cs->preroll_us = 0;
+		cs->play_us = 0;
+		cs->export_sink = NULL;
+		cs->cap = CAP_AUTO;
+		cs->open_us = 0;
+		camera_create_export(cs, &md->cfg[i]);
+
+		/* the mosaic is camera 0, the other cameras have no pipeline of their own */
+		if (g_mosaic && i > 0)
+			continue;
+
+		int ret = g_mosaic ? camera_open_mosaic(cs, md->cfg, md->count, &md->callbacks) :
+				camera_open(cs, &md->cfg[i], &md->callbacks);
+		if (ret < 0) {
+			/* retried like a camera that failed later, the others still stream meanwhile */
+			cs->layer_num = (g_simulcast && !g_mosaic) ? 2 : 1;
+			cs->failed = true;
+			printf("camera%u: open failed, next try in %d s\n", cs->ch, cs->backoff_s);
+			camera_schedule_restart(cs);
+		}
+
+		for (int j = 0; j < cs->layer_num; j++)
+			cs->layers[j].tid = std::thread(camera_send_proc, &cs->layers[j]);
+		if (ret < 0)
+			continue;
+
+		camera_attach(cs);
+
+		/* Open, negotiate and encode one frame now, then idle in PAUSED until a viewer joins. */
+		if (g_preroll) {
+			cs->prerolling = true;
+			cs->preroll_us = hal_now_us();
+			camera_set_state(cs, GST_STATE_PLAYING);
+		}
 	}
-	
+
+	camera_watch_devices(md);
+	md->watchdog = g_timeout_add_seconds(WATCHDOG_INTERVAL_S, media_device_watchdog, md);
+
+	md->loop = g_main_loop_new(NULL, FALSE);
+	md->loop_tid = std::thread(media_device_loop_proc, md);
+
+	md->inited = true;
 	printf("media_device_init success.\n");
 	return 0;
 }
 
+typedef struct bench_counter {
+	std::atomic<uint32_t>	frames;
+	std::atomic<uint64_t>	bytes;
+} bench_counter_t;
+
+static GstFlowReturn on_bench_data(GstAppSink *sink, gpointer data)
+{
+	bench_counter_t *bc = (bench_counter_t *)data;
+
+	GstSample *sample = gst_app_sink_pull_sample(sink);
+	if (!sample)
+		return GST_FLOW_ERROR;
+
+	bc->frames++;
+	bc->bytes += gst_buffer_get_size(gst_sample_get_buffer(sample));
+	gst_sample_unref(sample);
+	return GST_FLOW_OK;
+}
+
+static uint64_t cpu_time_us()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void camera_bench(int ch, const hal_camera_cfg_t *cfg, capture_e cap, int seconds)
+{
+	const char *name = camera_is_test(cfg) ? "test" : g_capture_name[cap];
+	capture_path_t path;
+	codec_e codec;
+	enc_kind_e kind;
+
+	if (camera_probe_encoder(cfg, &codec, &kind) < 0) {
+		printf("camera%d %-6s: no video encoder available\n", ch, name);
+		return;
+	}
+	if (camera_resolve_capture(cfg, cap, &path) < 0 || (cap != path.cap && !camera_is_test(cfg))) {
+		printf("camera%d %-6s: not available\n", ch, name);
+		return;
+	}
+
+	char desc[PIPELINE_DESC_MAX];
+	GError *err = NULL;
+	camera_build_pipeline(cfg, &path, codec, kind, false, false, desc, sizeof(desc));
+	GstElement *pipeline = gst_parse_launch(desc, &err);
+	if (err) {
+		printf("camera%d %-6s: %s\n", ch, name, err->message);
+		g_error_free(err);
+	}
+	if (!pipeline)
+		return;
+
+	GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "app-sink");
+	if (!sink) {
+		gst_object_unref(pipeline);
+		return;
+	}
+
+	bench_counter_t bc;
+	bc.frames = 0;
+	bc.bytes = 0;
+
+	GstAppSinkCallbacks callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.new_sample = on_bench_data;
+	g_object_set(sink, "emit-signals", FALSE, "sync", FALSE, NULL);
+	gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, &bc, NULL);
+
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+		printf("camera%d %-6s: failed to start\n", ch, name);
+	} else {
+		/* skip negotiation and encoder start-up */
+		sleep(BENCH_WARMUP_S);
+
+		uint32_t frames = bc.frames;
+		uint64_t bytes = bc.bytes;
+		uint64_t cpu = cpu_time_us();
+		uint64_t start = hal_now_us();
+		hal_trace_attach(ch, pipeline);
+
+		sleep(seconds);
+
+		double wall_s = (hal_now_us() - start) / 1e6;
+		double cpu_s = (cpu_time_us() - cpu) / 1e6;
+		printf("camera%d %-6s %-12s %5.1f fps %6.0f kbit/s cpu %5.1f%%\n", ch, name,
+				g_encoder_name[codec][kind], (bc.frames - frames) / wall_s,
+				(bc.bytes - bytes) * 8 / wall_s / 1000, cpu_s * 100 / wall_s);
+		hal_trace_print(ch);
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	hal_trace_detach(ch);
+	gst_object_unref(sink);
+	gst_object_unref(pipeline);
+}
+
+int media_device_bench(int seconds)
+{
+	media_device_t *md = &g_media_deivce;
+
+	gst_init(NULL, NULL);
+
+	if (!md->configured)
+		media_device_config(NULL, 0);
+
+	/* one variant at a time, so the CPU of the whole process is the variant's */
+	for (int i = 0; i < md->count; i++) {
+		if (camera_is_test(&md->cfg[i])) {
+			camera_bench(i, &md->cfg[i], CAP_RAW, seconds);
+			continue;
+		}
+		for (int cap = CAP_MJPEG; cap < CAP_NUM; cap++)
+			camera_bench(i, &md->cfg[i], (capture_e)cap, seconds);
+	}
+
+	return 0;
+}
+
 void meida_device_final()
 {
 	media_device_t *md = &g_media_deivce;
-	memset(md, 0, sizeof(media_device_t));
+
+	if (md->loop) {
+		g_main_loop_quit(md->loop);
+		if (md->loop_tid.joinable())
+			md->loop_tid.join();
+		g_main_loop_unref(md->loop);
+		md->loop = NULL;
+	}
+
+	if (md->watchdog) {
+		g_source_remove(md->watchdog);
+		md->watchdog = 0;
+	}
+	if (md->inotify_watch) {
+		g_source_remove(md->inotify_watch);
+		md->inotify_watch = 0;
+	}
+	if (md->inotify_ch) {
+		g_io_channel_unref(md->inotify_ch);
+		md->inotify_ch = NULL;
+	}
+	if (md->inotify_fd >= 0) {
+		close(md->inotify_fd);
+		md->inotify_fd = -1;
+	}
+
+	for (int i = 0; i < md->count; i++) {
+		CameraService *cs = &md->camera_services[i];
+		if (cs->restart_timer) {
+			g_source_remove(cs->restart_timer);
+			cs->restart_timer = 0;
+		}
+		if (cs->pipeline)
+			camera_teardown(cs);
+
+		for (int j = 0; j < cs->layer_num; j++) {
+			camera_layer_t *ly = &cs->layers[j];
+			{
+				std::lock_guard<std::mutex> lg(ly->mtx);
+				ly->b_exit = true;
+				ly->cond.notify_one();
+			}
+			if (ly->tid.joinable())
+				ly->tid.join();
+		}
+
+		hal_shm_destroy(cs->shm_raw);
+		hal_shm_destroy(cs->shm_enc);
+		cs->shm_raw = NULL;
+		cs->shm_enc = NULL;
+	}
+
 	md->inited = false;
 }
 
 int media_device_start(int ch, const void *ctx)
 {
-	if (ch >= CAMERA_NUM) {
+	if (camera_post_event(ch, CAM_EV_START, 0) < 0) {
 		printf("media_device_start failed.\n");
 		return -1;
 	}
 
+	return 0;
+}
+
+int media_device_stop(int ch)
+{
+	return camera_post_event(ch, CAM_EV_STOP, 0);
+}
+
+int media_device_stop_all()
+{
 	media_device_t *md = &g_media_deivce;
-	gst_element_set_state(md->camera_services[ch].pipeline, GST_STATE_PLAYING);
+
+	for (int i = 0; i < md->count; i++)
+		media_device_stop(i);
 
 	return 0;
 }
 
-int media_device_stop(int ch)
+int media_device_set_viewers(int ch, int viewers)
+{
+	return camera_post_event(ch, CAM_EV_VIEWERS, viewers < 0 ? 0 : viewers);
+}
+
+void media_device_set_idle_grace(int grace_s)
+{
+	g_idle_grace_s = grace_s;
+}
+
+void media_device_set_preroll(bool preroll)
+{
+	g_preroll = preroll;
+}
+
+void media_device_set_codec(hal_enc_type_e codec)
+{
+	g_codec = codec;
+}
+
+int media_device_set_mosaic(const char *layout)
+{
+	if (!layout) {
+		g_mosaic = false;
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof(g_mosaic_layouts) / sizeof(g_mosaic_layouts[0]); i++) {
+		if (strcmp(layout, g_mosaic_layouts[i].name) == 0) {
+			memcpy(g_mosaic_rect, g_mosaic_layouts[i].rect, sizeof(g_mosaic_rect));
+			g_mosaic = true;
+			return 0;
+		}
+	}
+
+	/* "x:y:w:h,x:y:w:h,..." one rectangle per camera */
+	mosaic_rect_t rect[CAMERA_MAX];
+	memset(rect, 0, sizeof(rect));
+	const char *p = layout;
+	for (int i = 0; i < CAMERA_MAX && *p; i++) {
+		mosaic_rect_t *r = &rect[i];
+		int n = 0;
+		if (sscanf(p, "%d:%d:%d:%d%n", &r->x, &r->y, &r->w, &r->h, &n) != 4 ||
+				r->w <= 0 || r->h <= 0 || r->x < 0 || r->y < 0 ||
+				r->x + r->w > MOSAIC_WIDTH || r->y + r->h > MOSAIC_HEIGHT) {
+			printf("media_device: bad mosaic layout %s\n", layout);
+			return -1;
+		}
+		p += n;
+		if (*p == ',')
+			p++;
+	}
+
+	memcpy(g_mosaic_rect, rect, sizeof(g_mosaic_rect));
+	g_mosaic = true;
+	return 0;
+}
+
+void media_device_set_export(int mode)
+{
+	g_export = mode;
+}
+
+void media_device_set_simulcast(bool simulcast)
+{
+	g_simulcast = simulcast;
+}
+
+int media_device_request_key_frame(int ch, hal_stream_type_e type)
+{
+	media_device_t *md = &g_media_deivce;
+	if (ch < 0 || ch >= md->count)
+		return -1;
+
+	camera_layer_t *ly = camera_layer(&md->camera_services[ch], type);
+	if (!ly)
+		return -1;
+
+	return camera_force_key_unit(ly, KEY_REQ_INTERVAL_US);
+}
+
+static void camera_apply_bitrate(camera_layer_t *ly, enc_kind_e kind, uint32_t bps)
+{
+	if (!ly->encoder)
+		return;
+
+	if (kind == ENC_V4L2) {
+		GstStructure *controls = gst_structure_new("encode",
+				"video_bitrate", G_TYPE_INT, (int)bps,
+				"video_bitrate_mode", G_TYPE_INT, 0, NULL);
+		g_object_set(ly->encoder, "extra-controls", controls, NULL);
+		gst_structure_free(controls);
+	} else {
+		/* the VA-API and software encoders take kbit/s */
+		g_object_set(ly->encoder, "bitrate", (guint)(bps / 1000), NULL);
+	}
+
+	printf("%s: bitrate %u -> %u\n", ly->name, ly->bitrate, bps);
+	ly->bitrate = bps;
+}
+
+/*
+ * Enables the layers both the viewer and the bandwidth allow. A disabled
+ * simulcast branch is stopped by its valve before the encoder, so it costs no
+ * CPU; an enabled one restarts on a forced IDR. Called with bitrate_mtx held.
+ */
+static void camera_apply_layers(CameraService *cs)
+{
+	uint32_t mask = cs->layer_mask & cs->auto_mask;
+
+	for (int i = 0; i < cs->layer_num; i++) {
+		camera_layer_t *ly = &cs->layers[i];
+		bool enabled = mask & (ly->type == HST_SUB ? HAL_LAYER_LOW : HAL_LAYER_HIGH);
+		{
+			std::lock_guard<std::mutex> lg(ly->mtx);
+			if (ly->enabled == enabled)
+				continue;
+			ly->enabled = enabled;
+			if (!enabled) {
+				frame_queue_flush(ly);
+				ly->wait_idr = true;
+			}
+		}
+
+		printf("%s: %s\n", ly->name, enabled ? "enabled" : "disabled");
+		if (ly->valve)
+			g_object_set(ly->valve, "drop", enabled ? FALSE : TRUE, NULL);
+		if (enabled)
+			camera_force_key_unit(ly, 0);
+	}
+}
+
+/*
+ * The sum of all per-connection targets is the uplink budget. It is split by
+ * priority, cameras that hit BITRATE_MAX hand their excess to the others.
+ * A camera's enabled low layer takes its fixed rate off the camera's share;
+ * when what is left is too little for a useful high layer only the low one
+ * is sent.
+ */
+static void media_device_rebalance(media_device_t *md)
+{
+	uint32_t share[CAMERA_MAX];
+	bool capped[CAMERA_MAX];
+	uint64_t budget = 0;
+	uint64_t now = hal_now_us();
+
+	for (int i = 0; i < md->count; i++) {
+		budget += md->camera_services[i].target_bps;
+		share[i] = 0;
+		capped[i] = md->camera_services[i].target_bps == 0;
+	}
+
+	while (budget > 0) {
+		uint32_t weights = 0;
+		for (int i = 0; i < md->count; i++) {
+			if (!capped[i])
+				weights += md->camera_services[i].priority;
+		}
+		if (weights == 0)
+			break;
+
+		uint64_t left = budget;
+		bool again = false;
+		for (int i = 0; i < md->count; i++) {
+			if (capped[i])
+				continue;
+			uint64_t s = budget * md->camera_services[i].priority / weights;
+			if (share[i] + s >= BITRATE_MAX) {
+				s = BITRATE_MAX - share[i];
+				capped[i] = true;
+				again = true;
+			}
+			share[i] += s;
+			left -= s;
+		}
+
+		budget = again ? left : 0;
+	}
+
+	for (int i = 0; i < md->count; i++) {
+		CameraService *cs = &md->camera_services[i];
+		if (cs->target_bps == 0 || !cs->layer_num)
+			continue;
+
+		uint32_t high = share[i];
+		/* without a low layer to fall back to the high one always stays */
+		uint32_t auto_mask = HAL_LAYER_HIGH | HAL_LAYER_LOW;
+		if (cs->layer_num > 1 && (cs->layer_mask & HAL_LAYER_LOW)) {
+			high = high > LOW_BITRATE ? high - LOW_BITRATE : 0;
+			if (high < HIGH_MIN_BPS)
+				auto_mask = HAL_LAYER_LOW;
+			else if (high < HIGH_MIN_BPS + HIGH_MIN_BPS / 4)
+				auto_mask = cs->auto_mask;
+		}
+		if (auto_mask != cs->auto_mask) {
+			cs->auto_mask = auto_mask;
+			camera_apply_layers(cs);
+		}
+
+		camera_layer_t *ly = &cs->layers[0];
+		uint32_t bps = high < BITRATE_MIN ? BITRATE_MIN : high;
+		uint32_t diff = bps > ly->bitrate ? bps - ly->bitrate : ly->bitrate - bps;
+		if (diff < ly->bitrate / BITRATE_HYST_DIV) {
+			cs->up_since_us = 0;
+			continue;
+		}
+
+		if (bps < ly->bitrate) {
+			cs->up_since_us = 0;
+			camera_apply_bitrate(ly, cs->enc_kind, bps);
+		} else if (!cs->up_since_us) {
+			cs->up_since_us = now;
+		} else if (now - cs->up_since_us >= BITRATE_UP_HOLD_US) {
+			cs->up_since_us = 0;
+			camera_apply_bitrate(ly, cs->enc_kind, bps);
+		}
+	}
+}
+
+int media_device_set_target_bitrate(int ch, uint32_t bps)
 {
 	media_device_t *md = &g_media_deivce;
+	if (ch < 0 || ch >= md->count || !md->inited)
+		return -1;
 
+	std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+	md->camera_services[ch].target_bps = bps;
+	media_device_rebalance(md);
 	return 0;
 }
 
-int media_device_stop_all()
+int media_device_set_priority(int ch, uint32_t priority)
+{
+	media_device_t *md = &g_media_deivce;
+	if (ch < 0 || ch >= md->count)
+		return -1;
+
+	std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+	md->camera_services[ch].priority = priority ? priority : 1;
+	return 0;
+}
+
+int media_device_set_layers(int ch, uint32_t layers)
 {
 	media_device_t *md = &g_media_deivce;
+	if (ch < 0 || ch >= md->count || !md->inited || !md->camera_services[ch].layer_num)
+		return -1;
+
+	/* without simulcast the high layer is the camera's only stream */
+	if (!g_simulcast && !(layers & HAL_LAYER_HIGH)) {
+		printf("media_device_set_layers camera[%d] ignore mask[0x%x] without simulcast\n", ch, layers);
+		return -1;
+	}
 
+	std::lock_guard<std::mutex> lg(md->bitrate_mtx);
+	CameraService *cs = &md->camera_services[ch];
+	cs->layer_mask = layers;
+	camera_apply_layers(cs);
+	/* the low layer's rate moves between the layers of this camera */
+	media_device_rebalance(md);
 	return 0;
 }
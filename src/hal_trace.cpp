@@ -0,0 +1,215 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "hal_trace.h"
+#include "hal_stream.h"
+#include "hal_stat.h"
+#include "gst/gst.h"
+#include <mutex>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#define TRACE_CAMERA_MAX	HAL_CAMERA_MAX
+/* Buffers inside one element, more than any queue or encoder here holds. */
+#define TRACE_PENDING_MAX	32
+
+typedef struct trace_pending {
+	GstClockTime	pts;
+	uint64_t	in_us;
+} trace_pending_t;
+
+typedef struct trace_elem {
+	char		name[32];
+	GstPad		*sink;
+	GstPad		*src;
+	gulong		sink_probe;
+	gulong		src_probe;
+	/* sink and src probes run on different streaming threads */
+	std::mutex	mtx;
+	trace_pending_t	pending[TRACE_PENDING_MAX];
+	int		head;
+	int		cnt;
+	uint32_t	unmatched;
+	hal_hist_t	proc_us;	/* sink pad -> src pad */
+	hal_hist_t	depth;		/* buffers left inside, not us */
+} trace_elem_t;
+
+typedef struct hal_trace {
+	bool		enabled;
+	std::mutex	mtx;
+	std::vector<trace_elem_t *> elems[TRACE_CAMERA_MAX];
+} hal_trace_t;
+
+static hal_trace_t g_trace;
+
+static GstPadProbeReturn trace_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	trace_elem_t *te = (trace_elem_t *)data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	uint64_t now = hal_now_us();
+
+	std::lock_guard<std::mutex> lg(te->mtx);
+	if (te->cnt == TRACE_PENDING_MAX) {
+		/* dropped inside the element, e.g. by a closed valve */
+		te->head = (te->head + 1) % TRACE_PENDING_MAX;
+		te->cnt--;
+	}
+
+	trace_pending_t *p = &te->pending[(te->head + te->cnt) % TRACE_PENDING_MAX];
+	p->pts = GST_BUFFER_PTS(buffer);
+	p->in_us = now;
+	te->cnt++;
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn trace_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	trace_elem_t *te = (trace_elem_t *)data;
+	GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+	uint64_t now = hal_now_us();
+
+	std::lock_guard<std::mutex> lg(te->mtx);
+	if (te->cnt == 0)
+		return GST_PAD_PROBE_OK;
+
+	/* elements here keep the PTS, without one the oldest buffer is taken */
+	int i = 0;
+	if (GST_CLOCK_TIME_IS_VALID(pts)) {
+		while (i < te->cnt && te->pending[(te->head + i) % TRACE_PENDING_MAX].pts != pts)
+			i++;
+		if (i == te->cnt) {
+			te->unmatched++;
+			return GST_PAD_PROBE_OK;
+		}
+	}
+
+	/* buffers that entered before this one and never left were dropped */
+	const trace_pending_t *p = &te->pending[(te->head + i) % TRACE_PENDING_MAX];
+	hal_hist_add(&te->proc_us, now - p->in_us);
+	te->head = (te->head + i + 1) % TRACE_PENDING_MAX;
+	te->cnt -= i + 1;
+	hal_hist_add(&te->depth, te->cnt);
+	return GST_PAD_PROBE_OK;
+}
+
+static void trace_elem_free(trace_elem_t *te)
+{
+	gst_pad_remove_probe(te->sink, te->sink_probe);
+	gst_pad_remove_probe(te->src, te->src_probe);
+	gst_object_unref(te->sink);
+	gst_object_unref(te->src);
+	delete te;
+}
+
+void hal_trace_enable()
+{
+	g_trace.enabled = true;
+}
+
+bool hal_trace_enabled()
+{
+	return g_trace.enabled;
+}
+
+int hal_trace_attach(int ch, GstElement *pipeline)
+{
+	hal_trace_t *tr = &g_trace;
+	if (!tr->enabled || ch < 0 || ch >= TRACE_CAMERA_MAX)
+		return -1;
+
+	hal_trace_detach(ch);
+
+	std::vector<trace_elem_t *> elems;
+	GstIterator *it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+	GValue item = G_VALUE_INIT;
+	bool done = false;
+	while (!done) {
+		switch (gst_iterator_next(it, &item)) {
+		case GST_ITERATOR_OK: {
+			GstElement *element = (GstElement *)g_value_get_object(&item);
+			/* sources, sinks, tee and compositor have no such pad pair */
+			GstPad *sink = gst_element_get_static_pad(element, "sink");
+			GstPad *src = gst_element_get_static_pad(element, "src");
+			if (sink && src) {
+				trace_elem_t *te = new trace_elem_t;
+				snprintf(te->name, sizeof(te->name), "%s", GST_OBJECT_NAME(element));
+				te->sink = sink;
+				te->src = src;
+				te->head = 0;
+				te->cnt = 0;
+				te->unmatched = 0;
+				hal_hist_reset(&te->proc_us);
+				hal_hist_reset(&te->depth);
+				te->sink_probe = gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, trace_sink_probe, te, NULL);
+				te->src_probe = gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, trace_src_probe, te, NULL);
+				elems.push_back(te);
+			} else {
+				if (sink)
+					gst_object_unref(sink);
+				if (src)
+					gst_object_unref(src);
+			}
+			g_value_reset(&item);
+			break;
+		}
+		case GST_ITERATOR_RESYNC:
+			gst_iterator_resync(it);
+			break;
+		default:
+			done = true;
+			break;
+		}
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+
+	std::lock_guard<std::mutex> lg(tr->mtx);
+	tr->elems[ch] = elems;
+	return (int)elems.size();
+}
+
+void hal_trace_detach(int ch)
+{
+	hal_trace_t *tr = &g_trace;
+	if (!tr->enabled || ch < 0 || ch >= TRACE_CAMERA_MAX)
+		return;
+
+	std::lock_guard<std::mutex> lg(tr->mtx);
+	for (size_t i = 0; i < tr->elems[ch].size(); i++)
+		trace_elem_free(tr->elems[ch][i]);
+	tr->elems[ch].clear();
+}
+
+void hal_trace_print(int ch)
+{
+	hal_trace_t *tr = &g_trace;
+	if (!tr->enabled || ch < 0 || ch >= TRACE_CAMERA_MAX)
+		return;
+
+	/* iterated in reverse link order by the bin, printed source first */
+	std::lock_guard<std::mutex> lg(tr->mtx);
+	for (size_t i = tr->elems[ch].size(); i-- > 0; ) {
+		trace_elem_t *te = tr->elems[ch][i];
+		hal_hist_t proc;
+		hal_hist_t depth;
+		uint32_t unmatched;
+		{
+			std::lock_guard<std::mutex> lk(te->mtx);
+			proc = te->proc_us;
+			depth = te->depth;
+			unmatched = te->unmatched;
+			hal_hist_reset(&te->proc_us);
+			hal_hist_reset(&te->depth);
+			te->unmatched = 0;
+		}
+		if (proc.count == 0)
+			continue;
+
+		printf("camera%d trace %-14s n[%u] avg[%llu us] p50[<%u us] p99[<%u us] max[%u us] "
+				"depth avg[%.1f] max[%u] unmatched[%u]\n", ch, te->name, proc.count,
+				(unsigned long long)(proc.sum_us / proc.count), hal_hist_percentile(&proc, 50),
+				hal_hist_percentile(&proc, 99), proc.max_us, (double)depth.sum_us / depth.count,
+				depth.max_us, unmatched);
+	}
+}
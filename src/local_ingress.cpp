@@ -0,0 +1,170 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "local_ingress.h"
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define LOCAL_MSG_MAX	2048
+#define LOCAL_FD_MAX	2
+
+typedef struct local_ingress {
+	int		epfd;
+	int		evfd;
+	int		fds[LOCAL_FD_MAX];
+	int		nfds;
+	local_msg_cb_t	cb;
+	std::thread	tid;
+} local_ingress_t;
+
+/* nfds stays 0 until init succeeds */
+static local_ingress_t g_local;
+
+static int local_udp_open(const char *bind_addr, int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+		printf("local ingress: bad udp bind address %s\n", bind_addr);
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("local ingress: bind udp %s:%d failed: %s\n", bind_addr, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int local_unix_open(const char *name)
+{
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	/* abstract namespace: leading NUL, no filesystem entry to clean up */
+	size_t len = strlen(name);
+	if (len > sizeof(addr.sun_path) - 1)
+		len = sizeof(addr.sun_path) - 1;
+	memcpy(addr.sun_path + 1, name, len);
+
+	if (bind(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) < 0) {
+		printf("local ingress: bind unix @%s failed: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void local_ingress_proc()
+{
+	local_ingress_t *li = &g_local;
+	struct epoll_event events[LOCAL_FD_MAX + 1];
+	char msg[LOCAL_MSG_MAX];
+
+	while (1) {
+		int n = epoll_wait(li->epfd, events, LOCAL_FD_MAX + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == li->evfd)
+				return;
+
+			while (1) {
+				ssize_t len = recv(fd, msg, sizeof(msg), 0);
+				if (len <= 0)
+					break;
+				li->cb(msg, (int)len);
+			}
+		}
+	}
+}
+
+int local_ingress_init(const char *udp_addr, int udp_port, const char *unix_name, local_msg_cb_t cb)
+{
+	local_ingress_t *li = &g_local;
+	li->cb = cb;
+	li->nfds = 0;
+
+	if (udp_port > 0) {
+		int fd = local_udp_open(udp_addr, udp_port);
+		if (fd >= 0)
+			li->fds[li->nfds++] = fd;
+	}
+
+	if (unix_name && unix_name[0]) {
+		int fd = local_unix_open(unix_name);
+		if (fd >= 0)
+			li->fds[li->nfds++] = fd;
+	}
+
+	if (li->nfds == 0)
+		return -1;
+
+	li->epfd = epoll_create1(EPOLL_CLOEXEC);
+	li->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = li->evfd;
+	epoll_ctl(li->epfd, EPOLL_CTL_ADD, li->evfd, &ev);
+
+	for (int i = 0; i < li->nfds; i++) {
+		ev.data.fd = li->fds[i];
+		epoll_ctl(li->epfd, EPOLL_CTL_ADD, li->fds[i], &ev);
+	}
+
+	li->tid = std::thread(local_ingress_proc);
+
+	printf("local_ingress_init success, udp[%s:%d] unix[%s].\n", udp_addr, udp_port, unix_name ? unix_name : "");
+	return 0;
+}
+
+void local_ingress_final()
+{
+	local_ingress_t *li = &g_local;
+	if (li->nfds == 0)
+		return;
+
+	uint64_t one = 1;
+	if (write(li->evfd, &one, sizeof(one)) < 0)
+		printf("local ingress: wakeup failed.\n");
+
+	if (li->tid.joinable())
+		li->tid.join();
+
+	for (int i = 0; i < li->nfds; i++)
+		close(li->fds[i]);
+	close(li->evfd);
+	close(li->epfd);
+	li->nfds = 0;
+}
@@ -1,51 +1,223 @@
 #include "ST/SCServo.h"
 #include "st_dev.h"
-#include <queue>
 #include <thread>
 #include <mutex>
-#include <vector>
-#include <queue>
+#include <algorithm>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#define JOINT_NUMBER	ST_JOINT_NUMBER
+#define CMD_BUF_SIZE	16
+#define CTL_PERIOD_MS	40
+
+/* The fastest transit seen in the current or previous window is the reference for "late". */
+#define OFFSET_WINDOW_MS	10000
+/* A seq this far behind the last accepted one means the sender restarted. */
+#define SEQ_RESTART_GAP		1000
+
+typedef struct st_slot {
+	st_cmd_t	cmd;
+	int64_t		ideal_ms;	/* local arrival time had transit been minimal */
+	int64_t		play_ms;
+} st_slot_t;
+
+/*
+ * One sender's seq space, clock and queue, cloud and local controllers are
+ * unrelated. A setpoint waiting for its playout time only holds back its own
+ * source.
+ */
+typedef struct st_source {
+	st_slot_t	cmd_buf[CMD_BUF_SIZE];
+	int		cmd_head;
+	int		cmd_cnt;
+	uint32_t	last_seq;
+	bool		has_offset;
+	uint32_t	min_offset;
+	uint32_t	win_min_offset;
+	int64_t		win_start_ms;
+	int32_t		last_excess;
+	uint32_t	jitter_x16;
+} st_source_t;
 
-#define JOINT_NUMBER 6
 typedef struct st_device {
 	SMS_STS		sm_st;
 	std::mutex	mtx;
 	std::thread	tid;
 	bool		b_exit;
-	std::queue<std::vector<int>> cmd_queue;
+	st_source_t	src[ST_SRC_NUM];
+	int		playout_ms;
+	int		max_age_ms;
+	st_device_stats_t stats;
 	uint8_t		id[JOINT_NUMBER];
 	uint16_t	speed[JOINT_NUMBER];
 	uint8_t		acc[JOINT_NUMBER];
+	int16_t		target[JOINT_NUMBER];
+	uint32_t	target_mask;
 } st_dev_t;
 
 static st_dev_t *st_dev = nullptr;
 
+static int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns how much longer than the fastest recent transit this command took.
+ * Sender and local clocks are unrelated, only differences of offsets are used.
+ */
+static int32_t st_device_excess(st_source_t *src, uint32_t ts, int64_t now)
+{
+	uint32_t offset = (uint32_t)now - ts;
+
+	if (!src->has_offset) {
+		src->has_offset = true;
+		src->min_offset = offset;
+		src->win_min_offset = offset;
+		src->win_start_ms = now;
+		src->last_excess = 0;
+		src->jitter_x16 = 0;
+		return 0;
+	}
+
+	if (now - src->win_start_ms > OFFSET_WINDOW_MS) {
+		src->min_offset = src->win_min_offset;
+		src->win_min_offset = offset;
+		src->win_start_ms = now;
+	}
+
+	if ((int32_t)(offset - src->win_min_offset) < 0)
+		src->win_min_offset = offset;
+	if ((int32_t)(offset - src->min_offset) < 0)
+		src->min_offset = offset;
+
+	int32_t excess = (int32_t)(offset - src->min_offset);
+
+	/* RFC 3550 interarrival jitter */
+	int32_t d = excess - src->last_excess;
+	if (d < 0)
+		d = -d;
+	src->jitter_x16 += d - ((src->jitter_x16 + 8) >> 4);
+	src->last_excess = excess;
+
+	return excess;
+}
+
+static int st_device_delay(st_dev_t *dev, const st_source_t *src)
+{
+	if (dev->playout_ms <= 0)
+		return 0;
+
+	int delay = (int)(src->jitter_x16 >> 4) * 4;
+	if (delay < dev->playout_ms)
+		delay = dev->playout_ms;
+
+	/* the worker may pick a slot up one tick after play_ms, it must still be in time then */
+	if (dev->max_age_ms > 0 && delay > dev->max_age_ms - CTL_PERIOD_MS)
+		delay = dev->max_age_ms > CTL_PERIOD_MS ? dev->max_age_ms - CTL_PERIOD_MS : 0;
+
+	return delay;
+}
+
+/* Pops the setpoints of src that are due, the newest one in time ends up in out. */
+static bool st_device_pop(st_dev_t *dev, st_source_t *src, int64_t now, st_slot_t *out)
+{
+	bool found = false;
+
+	while (src->cmd_cnt > 0) {
+		st_slot_t *slot = &src->cmd_buf[src->cmd_head];
+		if (slot->play_ms > now)
+			break;
+
+		if (dev->max_age_ms > 0 && slot->cmd.ts && now - slot->ideal_ms > dev->max_age_ms) {
+			dev->stats.late++;
+		} else {
+			/* superseded by a newer setpoint due on the same tick */
+			if (found)
+				dev->stats.dropped++;
+			*out = *slot;
+			found = true;
+		}
+
+		src->cmd_head = (src->cmd_head + 1) % CMD_BUF_SIZE;
+		src->cmd_cnt--;
+	}
+
+	return found;
+}
+
+static bool st_device_next(st_dev_t *dev, st_cmd_t *cmd)
+{
+	int64_t now = now_ms();
+	int64_t best_ms = 0;
+	bool found = false;
+
+	std::lock_guard<std::mutex> lg(dev->mtx);
+	for (int i = 0; i < ST_SRC_NUM; i++) {
+		st_slot_t slot;
+		if (!st_device_pop(dev, &dev->src[i], now, &slot))
+			continue;
+
+		/* both sources due on this tick, the setpoint issued last wins */
+		if (found)
+			dev->stats.dropped++;
+		if (found && slot.ideal_ms < best_ms)
+			continue;
+		*cmd = slot.cmd;
+		best_ms = slot.ideal_ms;
+		found = true;
+	}
+
+	return found;
+}
+
 static void st_device_cmd_proc()
 {
 	while(!st_dev->b_exit) {
-		usleep(40 * 1000);
-
-		std::vector<int> angles;
-		{	
-			std::lock_guard<std::mutex> lg(st_dev->mtx);
-			if (st_dev->cmd_queue.size() > 0) {
-				angles = st_dev->cmd_queue.front();
-				st_dev->cmd_queue.pop();		
-			}
-		}
+		usleep(CTL_PERIOD_MS * 1000);
 
-		if (angles.size() != JOINT_NUMBER) {
+		st_cmd_t cmd;
+		if (!st_device_next(st_dev, &cmd)) {
 			continue;
 		}
-		
+
+		for (int i = 0; i < JOINT_NUMBER; i++) {
+			if (!(cmd.mask & (1u << i)))
+				continue;
+			st_dev->target[i] = cmd.pos[i];
+			if (cmd.flags & ST_CMD_F_SPEED)
+				st_dev->speed[i] = cmd.speed[i];
+			if (cmd.flags & ST_CMD_F_ACC)
+				st_dev->acc[i] = cmd.acc[i];
+		}
+		st_dev->target_mask |= cmd.mask;
+
+		uint8_t id[JOINT_NUMBER];
 		int16_t pos[JOINT_NUMBER];
+		uint16_t speed[JOINT_NUMBER];
+		uint8_t acc[JOINT_NUMBER];
+		int n = 0;
 		for (int i = 0; i < JOINT_NUMBER; i++) {
-			pos[i] = angles[i];
+			if (!(st_dev->target_mask & (1u << i)))
+				continue;
+			id[n] = st_dev->id[i];
+			pos[n] = st_dev->target[i];
+			speed[n] = st_dev->speed[i];
+			acc[n] = st_dev->acc[i];
+			n++;
 		}
 
-		st_dev->sm_st.SyncWritePosEx(st_dev->id, sizeof(st_dev->id), pos, st_dev->speed, st_dev->acc);
+		if (n == 0) {
+			continue;
+		}
+
+		st_dev->sm_st.SyncWritePosEx(id, n, pos, speed, acc);
+
+		std::lock_guard<std::mutex> lg(st_dev->mtx);
+		st_dev->stats.executed++;
 	}
 
 	printf("thread exit.\n");
@@ -59,32 +231,109 @@ int st_device_init(std::string dev_name)
 		st_dev->id[i] = i + 1;
 		st_dev->speed[i] = 400;
 		st_dev->acc[i] = 50;
+		st_dev->target[i] = 0;
 	}
+	st_dev->target_mask = 0;
+	memset(st_dev->src, 0, sizeof(st_dev->src));
+	st_dev->playout_ms = 0;
+	st_dev->max_age_ms = 0;
+	memset(&st_dev->stats, 0, sizeof(st_dev->stats));
 
 	if (!st_dev->sm_st.begin(1000000, dev_name.c_str())) {
 		return 1;
 	}
 
 	st_dev->b_exit = false;
-	
+
 	st_dev->tid = std::thread(st_device_cmd_proc);
 	return 0;
 }
 
-int st_device_ctl(std::vector<int> angles)
+int st_device_ctl(st_cmd_src_e from, const st_cmd_t *cmd)
 {
-	if (!st_dev)
+	if (!st_dev || from < 0 || from >= ST_SRC_NUM)
 		return 0;
 
 	if (st_dev->b_exit) {
 		return 0;
 	}
 
+	int64_t now = now_ms();
+
+	std::lock_guard<std::mutex> lg(st_dev->mtx);
+	st_source_t *src = &st_dev->src[from];
+	st_dev->stats.received++;
+
+	if (cmd->seq && src->last_seq) {
+		int32_t diff = (int32_t)(cmd->seq - src->last_seq);
+		if (diff < -SEQ_RESTART_GAP) {
+			src->has_offset = false;
+		} else if (diff <= 0) {
+			st_dev->stats.reordered++;
+			return 0;
+		}
+	}
+
+	int32_t excess = 0;
+	if (cmd->ts) {
+		excess = st_device_excess(src, cmd->ts, now);
+		if (st_dev->max_age_ms > 0 && excess > st_dev->max_age_ms) {
+			st_dev->stats.late++;
+			return 0;
+		}
+	}
+
+	if (cmd->seq)
+		src->last_seq = cmd->seq;
+
+	if (src->cmd_cnt == CMD_BUF_SIZE) {
+		src->cmd_head = (src->cmd_head + 1) % CMD_BUF_SIZE;
+		src->cmd_cnt--;
+		st_dev->stats.dropped++;
+	}
+
+	st_slot_t *slot = &src->cmd_buf[(src->cmd_head + src->cmd_cnt) % CMD_BUF_SIZE];
+	slot->cmd = *cmd;
+	slot->ideal_ms = now - excess;
+	slot->play_ms = cmd->ts ? slot->ideal_ms + st_device_delay(st_dev, src) : now;
+	src->cmd_cnt++;
+	return 0;
+}
+
+int st_device_set_playout(int playout_ms, int max_age_ms)
+{
+	if (!st_dev)
+		return -1;
+
+	/* a buffered setpoint has to leave room for its age check */
+	if (playout_ms > 0 && max_age_ms > 0 && playout_ms >= max_age_ms) {
+		printf("st_device: playout %d ms must be below max age %d ms\n", playout_ms, max_age_ms);
+		return -1;
+	}
+
 	std::lock_guard<std::mutex> lg(st_dev->mtx);
-	st_dev->cmd_queue.push(angles);
+	st_dev->playout_ms = playout_ms;
+	st_dev->max_age_ms = max_age_ms;
 	return 0;
 }
 
+void st_device_get_stats(st_device_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!st_dev)
+		return;
+
+	std::lock_guard<std::mutex> lg(st_dev->mtx);
+	*stats = st_dev->stats;
+	for (int i = 0; i < ST_SRC_NUM; i++) {
+		const st_source_t *src = &st_dev->src[i];
+		if (!src->has_offset)
+			continue;
+		stats->jitter_ms = std::max(stats->jitter_ms, src->jitter_x16 >> 4);
+		stats->playout_ms = std::max(stats->playout_ms, (uint32_t)st_device_delay(st_dev, src));
+	}
+}
+
 void st_device_final()
 {
 	st_dev->b_exit = true;
@@ -97,5 +346,9 @@ void st_device_final()
 
 	st_dev->sm_st.end();
 
+	printf("st_device stats: received[%u] executed[%u] dropped[%u] late[%u] reordered[%u]\n",
+			st_dev->stats.received, st_dev->stats.executed, st_dev->stats.dropped,
+			st_dev->stats.late, st_dev->stats.reordered);
+
 	delete st_dev;
 }
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "st_leader.h"
+#include <stdio.h>
+
+#define LEADER_RX_LEN	2
+
+int st_leader_open(st_leader_t *leader, const char *dev_name)
+{
+	for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+		leader->id[i] = i + 1;
+	}
+	leader->read_errors = 0;
+
+	if (!leader->sm_st.begin(1000000, dev_name)) {
+		printf("st_leader_open %s failed.\n", dev_name);
+		return -1;
+	}
+
+	for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+		leader->sm_st.EnableTorque(leader->id[i], 0);
+	}
+
+	leader->sm_st.syncReadBegin(ST_JOINT_NUMBER, LEADER_RX_LEN);
+	return 0;
+}
+
+uint32_t st_leader_read(st_leader_t *leader, int16_t pos[ST_JOINT_NUMBER])
+{
+	uint8_t rx[LEADER_RX_LEN];
+	uint32_t mask = 0;
+
+	leader->sm_st.syncReadPacketTx(leader->id, ST_JOINT_NUMBER, SMS_STS_PRESENT_POSITION_L, LEADER_RX_LEN);
+
+	for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+		if (!leader->sm_st.syncReadPacketRx(leader->id[i], rx)) {
+			leader->read_errors++;
+			continue;
+		}
+
+		pos[i] = leader->sm_st.syncReadRxPacketToWrod(15);
+		mask |= 1u << i;
+	}
+
+	return mask;
+}
+
+void st_leader_close(st_leader_t *leader)
+{
+	leader->sm_st.syncReadEnd();
+	leader->sm_st.end();
+}
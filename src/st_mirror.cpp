@@ -0,0 +1,205 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "st_mirror.h"
+#include "st_leader.h"
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MIRROR_CENTER	2048
+#define MIRROR_POS_MAX	4095
+
+typedef struct st_joint_map {
+	int		offset;
+	bool		invert;
+	float		scale;
+} st_joint_map_t;
+
+typedef struct st_mirror {
+	st_leader_t	leader;
+	SMS_STS		follower;
+	st_joint_map_t	map[ST_JOINT_NUMBER];
+	uint8_t		id[ST_JOINT_NUMBER];
+	uint16_t	speed[ST_JOINT_NUMBER];
+	uint8_t		acc[ST_JOINT_NUMBER];
+	int		period_ns;
+	bool		b_exit;
+	std::thread	tid;
+} st_mirror_t;
+
+static st_mirror_t *g_mirror = nullptr;
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int st_mirror_load_map(st_mirror_t *mr, const char *map_file)
+{
+	FILE *fp = fopen(map_file, "r");
+	if (!fp) {
+		printf("st_mirror: cannot open map %s\n", map_file);
+		return -1;
+	}
+
+	char line[128];
+	while (fgets(line, sizeof(line), fp)) {
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		int joint, offset, invert;
+		float scale;
+		if (sscanf(line, "%d %d %d %f", &joint, &offset, &invert, &scale) != 4)
+			continue;
+		if (joint < 0 || joint >= ST_JOINT_NUMBER)
+			continue;
+
+		mr->map[joint].offset = offset;
+		mr->map[joint].invert = invert != 0;
+		mr->map[joint].scale = scale;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int16_t st_mirror_map(const st_joint_map_t *map, int16_t pos)
+{
+	float d = (pos - MIRROR_CENTER) * map->scale;
+	int out = MIRROR_CENTER + (int)(map->invert ? -d : d) + map->offset;
+
+	if (out < 0)
+		out = 0;
+	if (out > MIRROR_POS_MAX)
+		out = MIRROR_POS_MAX;
+
+	return out;
+}
+
+static void st_mirror_proc()
+{
+	st_mirror_t *mr = g_mirror;
+	int64_t next = now_ns();
+	int64_t report = next + 1000000000LL;
+	uint32_t loops = 0;
+	int64_t lat_sum = 0;
+	int64_t lat_max = 0;
+
+	while (!mr->b_exit) {
+		int16_t leader_pos[ST_JOINT_NUMBER];
+		int64_t t0 = now_ns();
+
+		uint32_t mask = st_leader_read(&mr->leader, leader_pos);
+
+		uint8_t id[ST_JOINT_NUMBER];
+		int16_t pos[ST_JOINT_NUMBER];
+		uint16_t speed[ST_JOINT_NUMBER];
+		uint8_t acc[ST_JOINT_NUMBER];
+		int n = 0;
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (!(mask & (1u << i)))
+				continue;
+			id[n] = mr->id[i];
+			pos[n] = st_mirror_map(&mr->map[i], leader_pos[i]);
+			speed[n] = mr->speed[i];
+			acc[n] = mr->acc[i];
+			n++;
+		}
+
+		if (n > 0)
+			mr->follower.SyncWritePosEx(id, n, pos, speed, acc);
+
+		int64_t t1 = now_ns();
+		int64_t lat = t1 - t0;
+		lat_sum += lat;
+		if (lat > lat_max)
+			lat_max = lat;
+		loops++;
+
+		if (t1 >= report) {
+			printf("st_mirror: rate[%u Hz] latency avg[%lld us] max[%lld us] read_errors[%u]\n",
+					loops, (long long)(lat_sum / loops / 1000), (long long)(lat_max / 1000),
+					mr->leader.read_errors);
+			loops = 0;
+			lat_sum = 0;
+			lat_max = 0;
+			report = t1 + 1000000000LL;
+		}
+
+		next += mr->period_ns;
+		if (next < t1) {
+			next = t1;
+			continue;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	printf("st_mirror thread exit.\n");
+}
+
+int st_mirror_init(const char *leader_dev, const char *follower_dev, const char *map_file, int rate_hz)
+{
+	st_mirror_t *mr = new st_mirror_t;
+
+	for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+		mr->map[i].offset = 0;
+		mr->map[i].invert = false;
+		mr->map[i].scale = 1.0f;
+		mr->id[i] = i + 1;
+		mr->speed[i] = 0;
+		mr->acc[i] = 0;
+	}
+
+	if (map_file && st_mirror_load_map(mr, map_file) < 0) {
+		delete mr;
+		return -1;
+	}
+
+	if (rate_hz <= 0)
+		rate_hz = 200;
+	mr->period_ns = 1000000000 / rate_hz;
+
+	if (st_leader_open(&mr->leader, leader_dev) < 0) {
+		delete mr;
+		return -1;
+	}
+
+	if (!mr->follower.begin(1000000, follower_dev)) {
+		st_leader_close(&mr->leader);
+		delete mr;
+		return -1;
+	}
+
+	g_mirror = mr;
+	mr->b_exit = false;
+	mr->tid = std::thread(st_mirror_proc);
+
+	printf("st_mirror_init success, leader[%s] follower[%s] rate[%d Hz].\n", leader_dev, follower_dev, rate_hz);
+	return 0;
+}
+
+void st_mirror_final()
+{
+	st_mirror_t *mr = g_mirror;
+	if (!mr)
+		return;
+
+	mr->b_exit = true;
+	if (mr->tid.joinable())
+		mr->tid.join();
+
+	st_leader_close(&mr->leader);
+	mr->follower.end();
+
+	delete mr;
+	g_mirror = nullptr;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2023 Frodobots.ai. All rights reserved.
+ */
+#include "st_pub.h"
+#include "st_leader.h"
+#include "cmd_codec.h"
+#include "agora.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* RDT command stream packets are limited to 256 bytes. */
+#define PUB_MSG_MAX		256
+#define PUB_BATCH_MAX		8
+#define PUB_PENDING_MAX		16
+/* Send a full frame at least this often so a late joiner gets a reference. */
+#define PUB_KEY_INTERVAL_MS	1000
+/* Stay well inside the receiver's delta reference history. */
+#define PUB_REF_MAX_AGE		(CMD_HIST_SIZE / 2)
+/* Ack round trip the reference age has to cover, RTM takes the longest. */
+#define PUB_ACK_RTT_MAX_MS	500
+
+typedef struct st_pub_msg {
+	uint32_t	msg_id;
+	st_cmd_t	last;
+} st_pub_msg_t;
+
+typedef struct st_pub {
+	st_leader_t	leader;
+	std::thread	tid;
+	std::mutex	mtx;
+	bool		b_exit;
+	int		period_ns;
+	int		quant;
+	int		msg_rate;
+	uint32_t	seq;
+	uint32_t	msg_id;
+	uint32_t	ack_floor;	/* acks of older messages can't give a ref */
+	st_cmd_t	ref;		/* last delivered frame */
+	bool		has_ref;
+	st_pub_msg_t	pending[PUB_PENDING_MAX];
+	uint32_t	samples;
+	uint32_t	frames;
+	uint32_t	msgs;
+	uint32_t	bytes;
+	uint32_t	stale;		/* full frames sent because the ref got too old */
+	std::atomic<bool> force_key;
+} st_pub_t;
+
+static st_pub_t *g_pub = nullptr;
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Nearest multiple of q, halves away from zero so both directions round alike. */
+static int16_t st_pub_quantize(int16_t pos, int q)
+{
+	int v = pos < 0 ? -pos : pos;
+	v = (v + q / 2) / q * q;
+	return (int16_t)(pos < 0 ? -v : v);
+}
+
+static void st_pub_flush(st_pub_t *pub, uint8_t *msg, int *len, const st_cmd_t *last)
+{
+	if (*len == 0)
+		return;
+
+	uint32_t msg_id = ++pub->msg_id;
+	{
+		std::lock_guard<std::mutex> lg(pub->mtx);
+		st_pub_msg_t *pm = &pub->pending[msg_id % PUB_PENDING_MAX];
+		pm->msg_id = msg_id;
+		pm->last = *last;
+	}
+
+	if (agora_msg_send(msg, *len, msg_id) == 0) {
+		pub->msgs++;
+		pub->bytes += *len;
+	}
+	*len = 0;
+}
+
+static void st_pub_proc()
+{
+	st_pub_t *pub = g_pub;
+	uint8_t msg[PUB_MSG_MAX];
+	int msg_len = 0;
+	int batch_cnt = 0;
+	int batch = 1;
+	st_cmd_t prev;
+	bool has_prev = false;
+	int64_t next = now_ns();
+	int64_t last_key = 0;
+	int64_t report = next + 1000000000LL;
+
+	memset(&prev, 0, sizeof(prev));
+
+	while (!pub->b_exit) {
+		int16_t pos[ST_JOINT_NUMBER];
+		uint32_t mask = st_leader_read(&pub->leader, pos);
+		int64_t now = now_ns();
+		pub->samples++;
+
+		st_cmd_t cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+			if (mask & (1u << i)) {
+				cmd.pos[i] = st_pub_quantize(pos[i], pub->quant);
+			} else if (has_prev) {
+				cmd.pos[i] = prev.pos[i];
+			}
+		}
+		cmd.mask = has_prev ? (mask | prev.mask) : mask;
+
+		bool key = pub->force_key.exchange(false) || !has_prev || now - last_key > PUB_KEY_INTERVAL_MS * 1000000LL;
+		bool changed = key || cmd.mask != prev.mask ||
+			memcmp(cmd.pos, prev.pos, sizeof(cmd.pos)) != 0;
+
+		if (changed && cmd.mask) {
+			st_cmd_t ref;
+			bool has_ref;
+			{
+				std::lock_guard<std::mutex> lg(pub->mtx);
+				ref = pub->ref;
+				has_ref = pub->has_ref;
+			}
+			if (has_ref && ref.mask != cmd.mask)
+				has_ref = false;
+			if (has_ref && pub->seq + 1 - ref.seq > PUB_REF_MAX_AGE) {
+				has_ref = false;
+				if (!key)
+					pub->stale++;
+			}
+
+			cmd.seq = ++pub->seq;
+			cmd.ts = (uint32_t)(now / 1000000);
+
+			st_cmd_t frame = cmd;
+			if (has_ref && !key) {
+				frame.mask = 0;
+				for (int i = 0; i < ST_JOINT_NUMBER; i++) {
+					if (cmd.pos[i] != ref.pos[i])
+						frame.mask |= 1u << i;
+				}
+			} else {
+				last_key = now;
+			}
+
+			if (msg_len + CMD_BIN_MAX_LEN > PUB_MSG_MAX)
+				st_pub_flush(pub, msg, &msg_len, &prev);
+
+			int n = cmd_encode_bin(&frame, (has_ref && !key) ? &ref : NULL,
+					msg + msg_len, PUB_MSG_MAX - msg_len);
+			if (n > 0) {
+				msg_len += n;
+				batch_cnt++;
+				pub->frames++;
+			}
+
+			prev = cmd;
+			has_prev = true;
+		}
+
+		if (msg_len > 0 && batch_cnt >= batch) {
+			st_pub_flush(pub, msg, &msg_len, &prev);
+			batch_cnt = 0;
+
+			/*
+			 * Grow the batch while the link lags behind, shrink it back once it
+			 * drains. Only RDT, limited to 100 packets/s, needs msg_rate as a floor.
+			 */
+			int base = 1;
+			if (agora_msg_on_rdt())
+				base = (1000000000 / pub->period_ns + pub->msg_rate - 1) / pub->msg_rate;
+			if (agora_msg_backlog() > 0) {
+				batch = batch * 2 > PUB_BATCH_MAX ? PUB_BATCH_MAX : batch * 2;
+			} else {
+				batch = base;
+			}
+			if (batch < 1)
+				batch = 1;
+			if (batch > PUB_BATCH_MAX)
+				batch = PUB_BATCH_MAX;
+		}
+
+		if (now >= report) {
+			printf("st_pub: samples[%u] frames[%u] msgs[%u] bytes[%u] batch[%d] stale[%u] read_errors[%u]\n",
+					pub->samples, pub->frames, pub->msgs, pub->bytes, batch, pub->stale,
+					pub->leader.read_errors);
+			pub->samples = 0;
+			pub->stale = 0;
+			pub->frames = 0;
+			pub->msgs = 0;
+			pub->bytes = 0;
+			report = now + 1000000000LL;
+		}
+
+		next += pub->period_ns;
+		if (next < now) {
+			next = now;
+			continue;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	printf("st_pub thread exit.\n");
+}
+
+void st_pub_ack(uint32_t msg_id, bool delivered)
+{
+	st_pub_t *pub = g_pub;
+	if (!pub || !delivered)
+		return;
+
+	std::lock_guard<std::mutex> lg(pub->mtx);
+	st_pub_msg_t *pm = &pub->pending[msg_id % PUB_PENDING_MAX];
+	if (pm->msg_id != msg_id || (int32_t)(msg_id - pub->ack_floor) < 0)
+		return;
+
+	if (!pub->has_ref || (int32_t)(pm->last.seq - pub->ref.seq) > 0) {
+		pub->ref = pm->last;
+		pub->has_ref = true;
+	}
+}
+
+void st_pub_path(bool rdt)
+{
+	st_pub_t *pub = g_pub;
+	if (!pub || rdt)
+		return;
+
+	/*
+	 * The tunnel may have taken the acked ref with it, and the messages sent
+	 * so far may refer to it. Start over from a full frame.
+	 */
+	{
+		std::lock_guard<std::mutex> lg(pub->mtx);
+		pub->has_ref = false;
+		pub->ack_floor = pub->msg_id + 1;
+	}
+	pub->force_key = true;
+}
+
+int st_pub_init(const char *leader_dev, int rate_hz, int quant, int msg_rate)
+{
+	st_pub_t *pub = new st_pub_t;
+
+	if (rate_hz <= 0)
+		rate_hz = 200;
+	if (PUB_REF_MAX_AGE * 1000 / rate_hz < PUB_ACK_RTT_MAX_MS) {
+		printf("st_pub_init rate[%d Hz] too high, the delta history spans %d ms, an ack takes up to %d ms.\n",
+				rate_hz, PUB_REF_MAX_AGE * 1000 / rate_hz, PUB_ACK_RTT_MAX_MS);
+		delete pub;
+		return -1;
+	}
+	pub->period_ns = 1000000000 / rate_hz;
+	pub->quant = quant > 0 ? quant : 1;
+	pub->msg_rate = msg_rate > 0 ? msg_rate : 50;
+	pub->seq = 0;
+	pub->msg_id = 0;
+	pub->ack_floor = 0;
+	pub->has_ref = false;
+	pub->samples = 0;
+	pub->frames = 0;
+	pub->msgs = 0;
+	pub->bytes = 0;
+	pub->stale = 0;
+	pub->force_key = false;
+	memset(pub->pending, 0, sizeof(pub->pending));
+
+	if (st_leader_open(&pub->leader, leader_dev) < 0) {
+		delete pub;
+		return -1;
+	}
+
+	g_pub = pub;
+	pub->b_exit = false;
+	pub->tid = std::thread(st_pub_proc);
+
+	printf("st_pub_init success, leader[%s] rate[%d Hz] quant[%d] msg_rate[%d].\n",
+			leader_dev, rate_hz, pub->quant, pub->msg_rate);
+	return 0;
+}
+
+void st_pub_final()
+{
+	st_pub_t *pub = g_pub;
+	if (!pub)
+		return;
+
+	pub->b_exit = true;
+	if (pub->tid.joinable())
+		pub->tid.join();
+
+	st_leader_close(&pub->leader);
+
+	g_pub = nullptr;
+	delete pub;
+}